@@ -0,0 +1,192 @@
+//
+//  author dzhiblavi
+//
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "archive.hpp"
+#include "pipeline.hpp"
+
+#define DECODE_BATCH_SIZE 64000000
+
+namespace hfm {
+archive::archive(std::istream& in)
+: in_(&in)
+, starts_(1, 0) {
+    in_->seekg(0, in_->end);
+    length_ = in_->tellg();
+    read_tree_();
+    read_index_();
+}
+
+archive::archive(uint8_t const* data, size_t size)
+: mem_(data)
+, length_(size)
+, starts_(1, 0) {
+    read_tree_();
+    read_index_();
+}
+
+// memory is handed out in place, an istream is read into buff
+uint8_t const* archive::read_(uint64_t pos, size_t size, std::vector<uint8_t>& buff) {
+    if (pos + size > length_) {
+        throw std::runtime_error("corrupted file : unexpected end of file");
+    }
+    if (!in_) {
+        return mem_ + pos;
+    }
+    buff.resize(size);
+    in_->clear();
+    in_->seekg(pos);
+    in_->read(reinterpret_cast<char*>(buff.data()), size);
+    if ((size_t) in_->gcount() != size) {
+        throw std::runtime_error("corrupted file : unexpected end of file");
+    }
+    return buff.data();
+}
+
+void archive::read_tree_() {
+    std::vector<uint8_t> buff;
+    uint32_t len = read_binary_<uint32_t>(read_(0, HEADER_SIZE, buff) + HASH_SIZE_BYTES) & ~CANONICAL_FLAG;
+    auto tree = read_(0, HEADER_SIZE + len, buff);
+    tree_.prepare(tree, tree + HEADER_SIZE + len);
+    data_offset_ = HEADER_SIZE + len;
+}
+
+void archive::read_index_() {
+    uint64_t length = length_;
+    if (length < data_offset_ + HEADER_SIZE + INDEX_TRAILER_SIZE) {
+        return;
+    }
+
+    std::vector<uint8_t> buff;
+    auto trailer = read_(length - INDEX_TRAILER_SIZE, INDEX_TRAILER_SIZE, buff);
+    if (read_binary_<uint32_t>(trailer + 4) != INDEX_MAGIC) {
+        return;
+    }
+    uint32_t size = read_binary_<uint32_t>(trailer);
+    if (size < HEADER_SIZE + INDEX_TRAILER_SIZE || size > length - data_offset_
+            || (size - HEADER_SIZE - INDEX_TRAILER_SIZE) % INDEX_ENTRY_SIZE) {
+        throw std::runtime_error("corrupted file : incorrect index size");
+    }
+
+    auto index = read_(length - size, size, buff);
+    if (read_binary_<uint32_t>(index + HASH_SIZE_BYTES) != ((size - HEADER_SIZE) | BLOCK_INDEX_FLAG)
+            || read_binary_<uint32_t>(index) != crc32(index + HASH_SIZE_BYTES, size - HASH_SIZE_BYTES)) {
+        throw std::runtime_error("corrupted file : incorrect index hash sum");
+    }
+
+    uint64_t offset = 0;
+    for (auto it = index + HEADER_SIZE; it + INDEX_TRAILER_SIZE != index + size; it += INDEX_ENTRY_SIZE) {
+        tree::index_entry e {
+            read_binary_<uint64_t>(it),
+            read_binary_<uint32_t>(it + 8),
+            read_binary_<uint32_t>(it + 12)
+        };
+        if (e.offset != offset) {
+            throw std::runtime_error("corrupted file : index does not match blocks");
+        }
+        offset += e.size;
+        starts_.push_back(starts_.back() + e.count);
+        index_.push_back(e);
+    }
+    if (data_offset_ + offset + size != length) {
+        throw std::runtime_error("corrupted file : index does not match blocks");
+    }
+}
+
+bool archive::indexed() const {
+    return !index_.empty();
+}
+
+uint64_t archive::size() const {
+    return starts_.back();
+}
+
+void archive::decode_entries_(size_t first, size_t last, uint8_t const* data, uint8_t* out) {
+    uint64_t start = index_[first].offset;
+    thread_pool::instance().run(last - first, [&](size_t k) {
+        size_t i = first + k;
+        uint8_t const* src = data + index_[i].offset - start;
+        uint8_t* dst = out + starts_[i] - starts_[first];
+        uint8_t* dst_end = dst + index_[i].count;
+        if (tree_.decode_blocks(src, src + index_[i].size, dst, dst_end) != dst_end) {
+            throw std::runtime_error("corrupted file : index does not match blocks");
+        }
+    });
+}
+
+uint8_t const* archive::read_blocks_(size_t first, size_t last, std::vector<uint8_t>& buff) {
+    uint64_t start = index_[first].offset;
+    return read_(data_offset_ + start, index_[last - 1].offset + index_[last - 1].size - start, buff);
+}
+
+// entries from first on, up to DECODE_BATCH_SIZE symbols or the one
+// holding symbol end
+size_t archive::batch_end_(size_t first, uint64_t end) const {
+    size_t last = first + 1;
+    while (last < index_.size() && starts_[last] < end
+            && starts_[last + 1] - starts_[first] <= DECODE_BATCH_SIZE) {
+        ++last;
+    }
+    return last;
+}
+
+void archive::decode(std::ostream& out) {
+    decode_range(0, size(), out);
+}
+
+void archive::decode(uint8_t* out) {
+    if (!indexed()) {
+        throw std::runtime_error("archive has no block index");
+    }
+    std::vector<uint8_t> buff;
+    for (size_t first = 0, last; first < index_.size(); first = last) {
+        last = batch_end_(first, size());
+        decode_entries_(first, last, read_blocks_(first, last, buff), out + starts_[first]);
+    }
+}
+
+void archive::decode_range(uint64_t offset, uint64_t length, std::ostream& out) {
+    if (!indexed()) {
+        throw std::runtime_error("archive has no block index");
+    }
+    if (offset > size() || length > size() - offset) {
+        throw std::out_of_range("range exceeds archive size");
+    }
+    uint64_t end = offset + length;
+    size_t next = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+
+    // batches are read, decoded and written at the same time
+    struct encoded {
+        size_t first, last;
+        uint8_t const* data;
+        std::vector<uint8_t> buff;
+    };
+    struct decoded {
+        std::vector<uint8_t> buff;
+        uint64_t from, to;
+    };
+    run_pipeline<encoded, decoded>(PIPELINE_DEPTH,
+        [&](encoded& e) {
+            if (next >= index_.size() || starts_[next] >= end) {
+                return false;
+            }
+            e.first = next;
+            e.last = next = batch_end_(next, end);
+            e.data = read_blocks_(e.first, e.last, e.buff);
+            return true;
+        },
+        [&](encoded& e, decoded& d) {
+            uint64_t start = starts_[e.first];
+            d.buff.resize(starts_[e.last] - start);
+            decode_entries_(e.first, e.last, e.data, d.buff.data());
+            d.from = std::max(offset, start) - start;
+            d.to = std::min(end, starts_[e.last]) - start;
+        },
+        [&](decoded& d) {
+            out.write(reinterpret_cast<char const*>(d.buff.data()) + d.from, d.to - d.from);
+        });
+}
+} // namespace hfm
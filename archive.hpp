@@ -0,0 +1,53 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_ARCHIVE_H_
+#define HUFFMAN_ARCHIVE_H_
+
+#include <iostream>
+#include <vector>
+
+#include "encoder.hpp"
+
+namespace hfm {
+// Seekable view of an encoded stream: reads the tree header and, if the
+// stream ends with a block index, decodes the indexed ranges on all
+// threads at once. The stream is either an istream or a block of memory,
+// e.g. a mapped file, which is then decoded in place.
+class archive {
+    std::istream* in_ = nullptr;
+    uint8_t const* mem_ = nullptr;
+    tree tree_;
+    uint64_t length_ = 0;
+    uint64_t data_offset_ = 0;
+    std::vector<tree::index_entry> index_;
+    std::vector<uint64_t> starts_;
+
+    void read_tree_();
+    void read_index_();
+    uint8_t const* read_(uint64_t pos, size_t size, std::vector<uint8_t>& buff);
+    uint8_t const* read_blocks_(size_t first, size_t last, std::vector<uint8_t>& buff);
+    size_t batch_end_(size_t first, uint64_t end) const;
+    // data holds the blocks of entries [first, last)
+    void decode_entries_(size_t first, size_t last, uint8_t const* data, uint8_t* out);
+
+public:
+    explicit archive(std::istream& in);
+    archive(uint8_t const* data, size_t size);
+    archive& operator=(archive const&) = delete;
+    archive(archive const&) = delete;
+
+    bool indexed() const;
+    uint64_t size() const;
+
+    void decode(std::ostream& out);
+    // writes all size() symbols to out
+    void decode(uint8_t* out);
+    // writes symbols [offset, offset + length) to out, decoding only the
+    // index entries that cover the range
+    void decode_range(uint64_t offset, uint64_t length, std::ostream& out);
+};
+} // namespace hfm
+
+#endif // HUFFMAN_ARCHIVE_H_
@@ -0,0 +1,69 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_BITWRITER_H_
+#define HUFFMAN_BITWRITER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "bitset.hpp"
+
+#define PACKED_CODE_BITS 56
+
+// Appends MSB-first codes to a string through a 64-bit accumulator.
+// Every put stores the whole accumulator and advances by the number of
+// completed bytes, so the destination must always have 8 spare bytes:
+// call reserve() with an upper bound of the bits about to be written.
+class bit_writer {
+    std::string& dst_;
+    size_t pos_;
+    uint64_t acc_ = 0;
+    uint32_t fill_ = 0;
+
+    void store_() {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        uint64_t word = __builtin_bswap64(acc_);
+#else
+        uint64_t word = acc_;
+#endif
+        std::memcpy(&dst_[pos_], &word, sizeof(word));
+        pos_ += fill_ >> 3;
+        acc_ <<= fill_ & ~7u;
+        fill_ &= 7;
+    }
+
+public:
+    explicit bit_writer(std::string& dst)
+    : dst_(dst)
+    , pos_(dst.size()) {}
+
+    void reserve(size_t bits) {
+        size_t need = pos_ + (bits >> 3) + 2 * sizeof(uint64_t);
+        if (need > dst_.size()) {
+            dst_.resize(std::max(need, dst_.size() << 1));
+        }
+    }
+
+    // 0 < len <= PACKED_CODE_BITS, code is right-aligned
+    void put(uint64_t code, uint32_t len) {
+        acc_ |= code << (64 - fill_ - len);
+        fill_ += len;
+        store_();
+    }
+
+    void put(bitset const& code) {
+        for (size_t i = 0; i < code.size(); ++i) {
+            put(code[i], 1);
+        }
+    }
+
+    void finish() {
+        dst_.resize(pos_ + (fill_ != 0));
+    }
+};
+
+#endif // HUFFMAN_BITWRITER_H_
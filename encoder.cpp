@@ -2,6 +2,8 @@
 //  author dzhiblavi
 //
 
+#include <cstring>
+
 #include "encoder.hpp"
 
 namespace hfm {
@@ -37,12 +39,12 @@ void tree::build_tree_(fcounter const& fc) {
     auto i = std::upper_bound(fc.freq(), fc.freq() + ALPH_SIZE, fcounter::smb{0, 0});
     size_t size = fc.freq() + ALPH_SIZE - i;
     if (!size) {
-        root = new node {};
+        root = new_node_({});
         return;
     }
     std::vector<node_ptr> q1(size), q2(size);
     for (size_t j = 0; j < size; ++j) {
-        q1[j] = new node {(i + j)->cnt, nullptr, nullptr, (i + j)->symb};
+        q1[j] = new_node_({(i + j)->cnt, nullptr, nullptr, (i + j)->symb});
     }
     size_t i1 = 0, i2 = 0;
     for (size_t k = 0; k < size - 1; ++k) {
@@ -51,18 +53,86 @@ void tree::build_tree_(fcounter const& fc) {
         node_ptr q21 = i2 < k ? q2[i2] : nullptr;
         node_ptr q22 = i2 + 1 < k ? q2[i2 + 1] : nullptr;
         if (less_(q11, q12, q21, q22) && less_(q11, q12, q11, q21)) {
-            q2[k] = new node {q11->f + q12->f, q11, q12, 0};
+            q2[k] = new_node_({q11->f + q12->f, q11, q12, 0});
             i1 += 2;
         } else if (less_(q11, q21, q11, q12) && less_(q11, q21, q21, q22)) {
-            q2[k] = new node {q11->f + q21->f, q11, q21, 0};
+            q2[k] = new_node_({q11->f + q21->f, q11, q21, 0});
             ++i1;
             ++i2;
         } else {
-            q2[k] = new node {q21->f + q22->f, q21, q22, 0};
+            q2[k] = new_node_({q21->f + q22->f, q21, q22, 0});
             i2 += 2;
         }
     }
-    root = q2[i2] ? q2[i2] : new node {q1[i1]->f, q1[i1], new node {}, 0};
+    root = q2[i2] ? q2[i2] : new_node_({q1[i1]->f, q1[i1], new_node_({}), 0});
+}
+
+void tree::build_tree_(uint8_t const* lengths) {
+    canonical_codes_(lengths);
+    root = new_node_({0, nullptr, nullptr});
+    for (size_t c = 0; c < ALPH_SIZE; ++c) {
+        bitset code = alph_map_.get(c);
+        node_ptr v = root;
+        for (size_t j = 0; j < code.size(); ++j) {
+            node_ptr& next = code[j] ? v->r : v->l;
+            if (!next) {
+                next = new_node_({0, nullptr, nullptr, 0, -1, v, code[j] != 0});
+            }
+            v = next;
+        }
+        if (code.size()) {
+            v->c = (char)c;
+        }
+    }
+}
+
+// package-merge: the lengths of the optimal code bounded by max_len are
+// given by the 2n - 2 cheapest items of the top level list, each leaf
+// adding one bit per occurrence
+void tree::limit_lengths_(fcounter const& fc, size_t max_len, uint8_t* lengths) const {
+    struct item {
+        size_t w;
+        int leaf;
+        size_t a, b;
+    };
+
+    auto i = std::upper_bound(fc.freq(), fc.freq() + ALPH_SIZE, fcounter::smb{0, 0});
+    size_t size = fc.freq() + ALPH_SIZE - i;
+    if (max_len < 64 && (1ull << max_len) < size) {
+        throw std::invalid_argument("code length limit is too small for the alphabet");
+    }
+
+    std::vector<item> leaves(size);
+    for (size_t j = 0; j < size; ++j) {
+        leaves[j] = {(i + j)->cnt, (int)j, 0, 0};
+    }
+    std::vector<std::vector<item>> lists(max_len);
+    lists[0] = leaves;
+    for (size_t l = 1; l < max_len; ++l) {
+        std::vector<item> packages;
+        for (size_t k = 0; k + 1 < lists[l - 1].size(); k += 2) {
+            packages.push_back({lists[l - 1][k].w + lists[l - 1][k + 1].w, -1, k, k + 1});
+        }
+        std::merge(leaves.begin(), leaves.end(), packages.begin(), packages.end(),
+                std::back_inserter(lists[l]), [](item const& a, item const& b) { return a.w < b.w; });
+    }
+
+    std::fill(lengths, lengths + ALPH_SIZE, 0);
+    std::vector<std::pair<size_t, size_t>> stack;
+    for (size_t k = 0; k + 2 < 2 * size; ++k) {
+        stack.emplace_back(max_len - 1, k);
+    }
+    while (!stack.empty()) {
+        auto [l, k] = stack.back();
+        stack.pop_back();
+        item const& it = lists[l][k];
+        if (it.leaf != -1) {
+            ++lengths[(uint8_t)(i + it.leaf)->symb];
+        } else {
+            stack.emplace_back(l - 1, it.a);
+            stack.emplace_back(l - 1, it.b);
+        }
+    }
 }
 
 void tree::calc_code_(node_ptr p, bitset& current_code_bitset,
@@ -77,7 +147,7 @@ void tree::calc_code_(node_ptr p, bitset& current_code_bitset,
         tree_code_bitset.push(0);
         tree_alphabet_bitset.append(bitset::from_uint8_t((uint8_t)p->c));
 
-        alph_map_[(uint8_t)p->c] = current_code_bitset;
+        alph_map_.assign(p->c, current_code_bitset);
     } else {
         tree_code_bitset.push(1);
         current_code_bitset.push(0);
@@ -88,34 +158,448 @@ void tree::calc_code_(node_ptr p, bitset& current_code_bitset,
     }
 }
 
+void tree::calc_lengths_(node_ptr p, uint8_t depth, uint8_t* lengths) {
+    if (!p) {
+        return;
+    }
+    if (!p->l) {
+        lengths[(uint8_t)p->c] = depth;
+    } else {
+        calc_lengths_(p->l, depth + 1, lengths);
+        calc_lengths_(p->r, depth + 1, lengths);
+    }
+}
+
+void tree::canonical_codes_(uint8_t const* lengths) {
+    std::vector<uint8_t> order;
+    alph_map_.clear();
+    for (size_t c = 0; c < ALPH_SIZE; ++c) {
+        if (lengths[c]) {
+            order.push_back(c);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [lengths](uint8_t a, uint8_t b) {
+        return lengths[a] < lengths[b];
+    });
+
+    lookup_.assign(LOOKUP_SIZE, lookup_entry());
+    bitset code;
+    for (size_t k = 0; k < order.size(); ++k) {
+        if (k) {
+            size_t i = code.size();
+            while (i && code[i - 1]) {
+                code.reset(--i);
+            }
+            if (!i) {
+                throw std::runtime_error("corrupted file : code lengths are over-subscribed");
+            }
+            code.set(i - 1);
+        }
+        while (code.size() < lengths[order[k]]) {
+            code.push(0);
+        }
+        alph_map_.assign(order[k], code);
+        insert_lookup_(code, (char)order[k]);
+    }
+    reset_decoding_();
+}
+
+void tree::write_lengths_(uint8_t const* lengths) {
+    size_t size = ALPH_SIZE;
+    while (size && !lengths[size - 1]) {
+        --size;
+    }
+    for (size_t i = 0; i < size;) {
+        if (lengths[i] & 0x80) {
+            throw std::length_error("code length does not fit canonical header");
+        }
+        if (lengths[i]) {
+            tree_code_ += char(lengths[i++]);
+            continue;
+        }
+        size_t run = 0;
+        for (; i < size && !lengths[i] && run < 0x80; ++i, ++run) {}
+        tree_code_ += char(0x80 | (run - 1));
+    }
+}
+
+void tree::write_tree_header_(uint32_t flags) {
+    write_binary_((uint32_t) (tree_code_.size() - HEADER_SIZE) | flags, tree_code_.begin() + HASH_SIZE_BYTES);
+    uint32_t hashh = crc32(tree_code_.begin(), tree_code_.end());
+    write_binary_(hashh, tree_code_.begin());
+}
+
 bool tree::header_initialized_() const {
     return header_cnt == HEADER_SIZE;
 }
 
-tree::node_ptr tree::decode_(node_ptr v, uint8_t x, uint8_t left) {
-    if (v->id != -1) {
-        decoded_.push_back(char_by_id_[v->id]);
-        v = root;
-        if (!--count) {
-            return v;
+void tree::build_lookup_() {
+    lookup_.assign(LOOKUP_SIZE, lookup_entry());
+    fill_lookup_(root, 0, 0, 0);
+    reset_decoding_();
+}
+
+void tree::fill_lookup_(node_ptr p, uint32_t table, uint32_t prefix, uint8_t depth) {
+    if (!p) {
+        return;
+    }
+    if (p->id != -1) {
+        uint32_t shift = LOOKUP_BITS - depth;
+        std::fill(lookup_.begin() + table + (prefix << shift),
+                lookup_.begin() + table + ((prefix + 1) << shift),
+                lookup_entry {0, depth, char_by_id_[p->id]});
+        return;
+    }
+    if (depth == LOOKUP_BITS) {
+        auto next = (uint32_t) lookup_.size();
+        lookup_.resize(next + LOOKUP_SIZE);
+        lookup_[table + prefix] = {next, LOOKUP_BITS, 0};
+        table = next;
+        prefix = depth = 0;
+    }
+    fill_lookup_(p->l, table, prefix << 1, depth + 1);
+    fill_lookup_(p->r, table, (prefix << 1) | 1, depth + 1);
+}
+
+void tree::insert_lookup_(bitset const& code, char c) {
+    uint32_t table = 0;
+    size_t pos = 0;
+    for (; code.size() - pos > LOOKUP_BITS; pos += LOOKUP_BITS) {
+        uint32_t index = 0;
+        for (size_t j = 0; j < LOOKUP_BITS; ++j) {
+            index = (index << 1) | code[pos + j];
         }
+        if (!lookup_[table + index].next) {
+            auto next = (uint32_t) lookup_.size();
+            lookup_.resize(next + LOOKUP_SIZE);
+            lookup_[table + index] = {next, LOOKUP_BITS, 0};
+        }
+        table = lookup_[table + index].next;
     }
-    if (!left) {
-        return v;
+    uint32_t prefix = 0;
+    for (size_t j = pos; j < code.size(); ++j) {
+        prefix = (prefix << 1) | code[j];
     }
-    if (x & (1 << (left - 1))) {
-        return decode_(v->r, x, left - 1);
+    auto depth = (uint8_t) (code.size() - pos);
+    uint32_t shift = LOOKUP_BITS - depth;
+    std::fill(lookup_.begin() + table + (prefix << shift),
+            lookup_.begin() + table + ((prefix + 1) << shift),
+            lookup_entry {0, depth, c});
+}
+
+void tree::reset_decoding_() {
+    bit_buffer = 0;
+    bit_count = 0;
+    cur_table = 0;
+}
+
+void tree::start_block_() {
+    reset_decoding_();
+    jump_left = streams_left = 0;
+    if (header_initialized_() && (block_flags & BLOCK_STREAMS_FLAG)) {
+        stream_total = jump_cnt = 0;
+        jump_left = sizeof(stream_total);
     }
-    return decode_(v->l, x, left - 1);
 }
 
-void tree::terminate_(node_ptr p) {
-    if (!p) {
+// a table block either switches back to a kept tree, or is followed by a
+// tree header restored the same way as the one at the start of the stream
+void tree::start_table_() {
+    check_block_hash_();
+    table_slot = count & (MAX_TABLES - 1);
+    if (!(count & TABLE_REF_FLAG)) {
+        tree_ok = false;
+    } else if (table_slot < tables_.size() && !tables_[table_slot].empty()) {
+        lookup_ = tables_[table_slot];
+    } else {
+        throw std::runtime_error("corrupted file : reference to unknown table");
+    }
+    count = header_cnt = block_flags = 0;
+}
+
+// the stream count is known once the first bytes of the stream table are
+// in, the rest of the table is only hashed
+void tree::read_stream_table_(uint8_t x) {
+    --jump_left;
+    if (jump_cnt < sizeof(stream_total)) {
+        stream_total |= (uint32_t) x << (8 * jump_cnt++);
+    }
+    if (jump_cnt != sizeof(stream_total) || streams_left) {
         return;
     }
-    terminate_(p->l);
-    terminate_(p->r);
-    delete p;
+    if (!stream_total || stream_total % STREAM_CNT || count / 8 < stream_total) {
+        throw std::runtime_error("corrupted file : incorrect stream table");
+    }
+    stream_count = count / (stream_total * 8) * 8;
+    last_stream_count = count - (stream_total - 1) * stream_count;
+    count = stream_count;
+    streams_left = stream_total - 1;
+    jump_left = 4 * streams_left;
+}
+
+void tree::decode_(uint8_t x) {
+    bit_buffer = (bit_buffer << 8) | x;
+    bit_count += 8;
+    decode_buffered_();
+}
+
+bool tree::output_full_() const {
+    return out_ && out_ == out_end_;
+}
+
+// decodes every symbol already complete in bit_buffer
+void tree::decode_buffered_() {
+    while (count && !output_full_()) {
+        uint32_t peek = bit_count >= LOOKUP_BITS
+                ? bit_buffer >> (bit_count - LOOKUP_BITS)
+                : bit_buffer << (LOOKUP_BITS - bit_count);
+        lookup_entry const& e = lookup_[cur_table + (peek & (LOOKUP_SIZE - 1))];
+        if (e.len > bit_count) {
+            return;
+        }
+        if (!e.len) {
+            throw std::runtime_error("corrupted file : symbol out of alphabet");
+        }
+        bit_count -= e.len;
+        if (e.next) {
+            cur_table = e.next;
+            continue;
+        }
+        if (out_) {
+            *out_++ = e.c;
+        } else {
+            decoded_.push_back(e.c);
+        }
+        cur_table = 0;
+        --count;
+    }
+    if (!count) {
+        reset_decoding_();
+    }
+}
+
+static uint64_t load_be64_(uint8_t const* p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+inline char tree::decode_symbol_(bit_stream& s) const {
+    uint32_t table = 0;
+    for (;;) {
+        if (s.bits < LOOKUP_BITS) {
+            if (s.last - s.first >= 8) {
+                s.buffer |= load_be64_(s.first) >> s.bits;
+                s.first += (63 - s.bits) >> 3;
+                s.bits |= 56;
+            } else {
+                for (; s.bits <= 56 && s.first != s.last; s.bits += 8) {
+                    s.buffer |= (uint64_t) *s.first++ << (56 - s.bits);
+                }
+            }
+        }
+        lookup_entry const& e = lookup_[table + (s.buffer >> (64 - LOOKUP_BITS))];
+        if (e.len > s.bits || !e.len) {
+            throw std::runtime_error("corrupted file : unexpected end of block");
+        }
+        s.buffer <<= e.len;
+        s.bits -= e.len;
+        if (!e.next) {
+            return e.c;
+        }
+        table = e.next;
+    }
+}
+
+// decodes whole symbols of the current block while at least 16 bytes are
+// left, then hands the unread bits back to the byte-wise state machine;
+// returns the end of the consumed bytes
+uint8_t const* tree::decode_fast_(uint8_t const* first, uint8_t const* last) {
+    if (cur_table || bit_count > 56 || !count) {
+        return first;
+    }
+    bit_stream s {first, last, bit_count ? bit_buffer << (64 - bit_count) : 0, bit_count};
+    uint8_t buff[ENCODE_BATCH];
+    while (count && last - s.first >= 16 && !output_full_()) {
+        // a caller buffer is filled in place, staged output goes in batches
+        uint8_t* dst = out_ ? out_ : buff;
+        size_t room = out_ ? out_end_ - out_ : ENCODE_BATCH;
+        size_t k = 0;
+        for (; k < room && count && last - s.first >= 16; ++k, --count) {
+            dst[k] = decode_symbol_(s);
+        }
+        if (out_) {
+            out_ += k;
+        } else {
+            decoded_.insert(decoded_.end(), buff, buff + k);
+        }
+    }
+
+    // whole bytes left in the bit buffer go back to the caller, the bits of
+    // the partly read byte may still hold complete symbols
+    auto unread = std::min<size_t>(s.bits >> 3, s.first - first);
+    bit_count = s.bits - 8 * unread;
+    bit_buffer = bit_count ? s.buffer >> (64 - bit_count) : 0;
+    decode_buffered_();
+    return s.first - unread;
+}
+
+uint8_t const* tree::decode_block_(uint8_t const* first, uint8_t const* last, uint8_t* out, uint32_t cnt) const {
+    bit_stream s {first, last};
+    for (; cnt; --cnt) {
+        *out++ = decode_symbol_(s);
+    }
+    return s.first - (s.bits >> 3);
+}
+
+// the streams are independent, so walking a group of them in lockstep
+// keeps STREAM_CNT table lookups in flight instead of one
+uint8_t const* tree::decode_streams_(uint8_t const* first, uint8_t const* last, uint8_t* out, uint8_t* out_end,
+        uint32_t cnt) const {
+    // the segments below are laid out by cnt, all within [out, out + cnt)
+    if ((size_t) (out_end - out) < cnt) {
+        throw std::runtime_error("corrupted file : block exceeds the expected size");
+    }
+    if (last - first < 4) {
+        throw std::runtime_error("corrupted file : truncated stream table");
+    }
+    auto streams = read_binary_<uint32_t>(first);
+    if (!streams || streams % STREAM_CNT || cnt / 8 < streams || (size_t) (last - first) / 4 < streams) {
+        throw std::runtime_error("corrupted file : incorrect stream table");
+    }
+    uint32_t segment = cnt / (streams * 8) * 8;
+    uint8_t const* start = first + 4 * streams;
+    // all stream sizes are checked before anything is written
+    uint64_t sizes = 0;
+    for (uint32_t k = 1; k < streams; ++k) {
+        sizes += read_binary_<uint32_t>(first + 4 * k);
+    }
+    if ((uint64_t) (last - start) < sizes) {
+        throw std::runtime_error("corrupted file : truncated stream");
+    }
+
+    for (uint32_t g = 0; g < streams; g += STREAM_CNT) {
+        bit_stream s[STREAM_CNT];
+        uint8_t* outs[STREAM_CNT];
+        uint8_t const* ends[STREAM_CNT] = {};
+        // every stream reads up to its own end only
+        for (size_t k = 0; k < STREAM_CNT; ++k) {
+            outs[k] = out + (size_t) (g + k) * segment;
+            uint8_t const* stream_first = start;
+            if (g + k + 1 < streams) {
+                ends[k] = start += read_binary_<uint32_t>(first + 4 * (g + k + 1));
+            }
+            s[k] = {stream_first, ends[k] ? ends[k] : last};
+        }
+        uint32_t i = 0;
+        while (i + 1 < segment) {
+            size_t room = SIZE_MAX;
+            for (auto& st : s) {
+                room = std::min<size_t>(room, st.last - st.first);
+            }
+            if (room < 8) {
+                break;
+            }
+            // a round moves a stream on by 7 bytes per refill, one here and
+            // at most one in each decode_symbol_, so every stream has 8
+            // bytes to load for this many rounds
+            uint32_t last_round = i + 2 * std::min<size_t>((room - 8) / 21 + 1, (segment - i) / 2);
+            for (; i < last_round; i += 2) {
+                for (auto& st : s) {
+                    st.buffer |= load_be64_(st.first) >> st.bits;
+                    st.first += (63 - st.bits) >> 3;
+                    st.bits |= 56;
+                }
+                for (size_t k = 0; k < STREAM_CNT; ++k) {
+                    outs[k][i] = decode_symbol_(s[k]);
+                }
+                for (size_t k = 0; k < STREAM_CNT; ++k) {
+                    outs[k][i + 1] = decode_symbol_(s[k]);
+                }
+            }
+        }
+        for (; i < segment; ++i) {
+            for (size_t k = 0; k < STREAM_CNT; ++k) {
+                outs[k][i] = decode_symbol_(s[k]);
+            }
+        }
+
+        for (size_t k = 0; k < STREAM_CNT; ++k) {
+            if (ends[k] && s[k].first - (s[k].bits >> 3) != ends[k]) {
+                throw std::runtime_error("corrupted file : stream sizes do not match");
+            }
+        }
+        if (g + STREAM_CNT == streams) {
+            bit_stream& tail = s[STREAM_CNT - 1];
+            for (uint32_t j = segment; j < cnt - (streams - 1) * segment; ++j) {
+                outs[STREAM_CNT - 1][j] = decode_symbol_(tail);
+            }
+            return tail.first - (tail.bits >> 3);
+        }
+    }
+    return start;
+}
+
+uint8_t* tree::decode_blocks(uint8_t const* first, uint8_t const* last, uint8_t* out, uint8_t* out_end) const {
+    while (first != last) {
+        if (last - first < HEADER_SIZE) {
+            throw std::runtime_error("corrupted file : truncated block header");
+        }
+        auto expected = read_binary_<uint32_t>(first);
+        auto cnt = read_binary_<uint32_t>(first + HASH_SIZE_BYTES);
+        // the count is not covered by a checked hash yet
+        if (!(cnt & BLOCK_INDEX_FLAG) && (size_t) (out_end - out) < (cnt & BLOCK_COUNT_MASK)) {
+            throw std::runtime_error("corrupted file : block exceeds the expected size");
+        }
+        uint8_t const* end;
+        if (cnt & BLOCK_INDEX_FLAG) {
+            if ((size_t) (last - first - HEADER_SIZE) < (cnt & BLOCK_COUNT_MASK)) {
+                throw std::runtime_error("corrupted file : truncated index");
+            }
+            end = first + HEADER_SIZE + (cnt & BLOCK_COUNT_MASK);
+        } else if ((cnt & ~BLOCK_COUNT_MASK) == BLOCK_STORED_FLAG) {
+            cnt &= BLOCK_COUNT_MASK;
+            if ((size_t) (last - first - HEADER_SIZE) < cnt) {
+                throw std::runtime_error("corrupted file : unexpected end of block");
+            }
+            end = first + HEADER_SIZE + cnt;
+            out = std::copy(first + HEADER_SIZE, end, out);
+        } else if ((cnt & ~BLOCK_COUNT_MASK) == BLOCK_STREAMS_FLAG) {
+            cnt &= BLOCK_COUNT_MASK;
+            end = decode_streams_(first + HEADER_SIZE, last, out, out_end, cnt);
+            out += cnt;
+        } else if (cnt & ~BLOCK_COUNT_MASK) {
+            throw std::runtime_error("corrupted file : unknown block type");
+        } else {
+            end = decode_block_(first + HEADER_SIZE, last, out, cnt);
+            out += cnt;
+        }
+        if (crc32(first + HASH_SIZE_BYTES, end) != expected) {
+            throw std::runtime_error("corrupted file : incorrect block hash sum");
+        }
+        first = end;
+    }
+    return out;
+}
+
+tree::node_ptr tree::new_node_(node const& n) {
+    if (nodes_.capacity() < MAX_TREE_NODES) {
+        nodes_.reserve(MAX_TREE_NODES);
+    }
+    // a tree over ALPH_SIZE symbols never has more nodes
+    if (nodes_.size() == MAX_TREE_NODES) {
+        throw std::runtime_error("corrupted file : too many tree nodes");
+    }
+    nodes_.push_back(n);
+    return &nodes_.back();
+}
+
+void tree::clear_nodes_() {
+    nodes_.clear();
+    root = cur_restore = nullptr;
 }
 
 void tree::trace_(node_ptr p, size_t d) const {
@@ -130,31 +614,61 @@ void tree::trace_(node_ptr p, size_t d) const {
     trace_(p->r, d + 1);
 }
 
-tree::tree(fcounter const& fcc) {
+tree::tree(fcounter const& fcc, size_t max_len)
+: tree(fcc, tree_header(), max_len) {}
+
+tree::tree(fcounter const& fcc, tree_header, size_t max_len) {
     fcounter fc(fcc);
     std::sort(fc.freq(), fc.freq() + ALPH_SIZE);
     build_tree_(fc);
 
+    uint8_t lengths[ALPH_SIZE] = {};
+    calc_lengths_(root, 0, lengths);
+    if (max_len && *std::max_element(lengths, lengths + ALPH_SIZE) > max_len) {
+        clear_nodes_();
+        limit_lengths_(fc, max_len, lengths);
+        build_tree_(lengths);
+    }
+
     size_t cnt = 0;
     bitset tree_code_bitset, tree_alphabet_bitset, current_code_bitset;
+    alph_map_.clear();
     calc_code_(root, current_code_bitset, tree_alphabet_bitset, tree_code_bitset, cnt);
 
     tree_code_ = std::string(HEADER_SIZE, '\0');
     tree_code_.append(tree_code_bitset.begin(), tree_code_bitset.end());
     tree_code_.append(tree_alphabet_bitset.begin(), tree_alphabet_bitset.end());
 
-    write_binary_((uint32_t) (tree_code_.size() - HEADER_SIZE), tree_code_.begin() + HASH_SIZE_BYTES);
-    uint32_t hashh = crc32(tree_code_.begin(), tree_code_.end());
-    write_binary_(hashh, tree_code_.begin());
+    write_tree_header_(0);
+    build_lookup_();
     tree_ok = true;
 }
 
-tree::~tree() {
-    terminate_(root);
+tree::tree(fcounter const& fcc, canonical_header, size_t max_len) {
+    fcounter fc(fcc);
+    std::sort(fc.freq(), fc.freq() + ALPH_SIZE);
+    build_tree_(fc);
+
+    uint8_t lengths[ALPH_SIZE] = {};
+    calc_lengths_(root, 0, lengths);
+    clear_nodes_();
+    if (max_len && *std::max_element(lengths, lengths + ALPH_SIZE) > max_len) {
+        limit_lengths_(fc, max_len, lengths);
+    }
+    canonical_codes_(lengths);
+
+    tree_code_ = std::string(HEADER_SIZE, '\0');
+    write_lengths_(lengths);
+
+    write_tree_header_(CANONICAL_FLAG);
+    canonical = tree_ok = true;
 }
 
+tree::~tree() = default;
+
 bool tree::read_finished_success() const {
-    return ((hash ^ CRCMASK) == expected_hash) && !count;
+    return tree_ok && ((hash ^ CRCMASK) == expected_hash) && !count && !streams_left && !jump_left
+            && !(block_flags & BLOCK_TABLE_FLAG);
 }
 
 void tree::check_block_hash_() const {
@@ -171,12 +685,71 @@ std::string const& tree::encode() const {
     return tree_code_;
 }
 
+void tree::drop_index() {
+    index_.clear();
+}
+
+std::string tree::encode_index() const {
+    size_t size = HEADER_SIZE + index_.size() * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    std::string ret(size, '\0');
+    auto it = ret.begin() + HEADER_SIZE;
+    for (index_entry const& e : index_) {
+        write_binary_(e.offset, it);
+        write_binary_(e.size, it + 8);
+        write_binary_(e.count, it + 12);
+        it += INDEX_ENTRY_SIZE;
+    }
+    write_binary_((uint32_t) size, it);
+    write_binary_((uint32_t) INDEX_MAGIC, it + 4);
+
+    write_binary_((uint32_t) (size - HEADER_SIZE) | BLOCK_INDEX_FLAG, ret.begin() + HASH_SIZE_BYTES);
+    write_binary_(crc32(ret.begin() + HASH_SIZE_BYTES, ret.end()), ret.begin());
+    return ret;
+}
+
+std::string tree::encode_table(uint32_t slot) const {
+    std::string ret(HEADER_SIZE, '\0');
+    write_binary_((uint32_t) (BLOCK_TABLE_FLAG | slot), ret.begin() + HASH_SIZE_BYTES);
+    write_binary_(crc32(ret.begin() + HASH_SIZE_BYTES, ret.end()), ret.begin());
+    return ret + tree_code_;
+}
+
+std::string tree::encode_table_ref(uint32_t slot) {
+    std::string ret(HEADER_SIZE, '\0');
+    write_binary_((uint32_t) (BLOCK_TABLE_FLAG | TABLE_REF_FLAG | slot), ret.begin() + HASH_SIZE_BYTES);
+    write_binary_(crc32(ret.begin() + HASH_SIZE_BYTES, ret.end()), ret.begin());
+    return ret;
+}
+
+uint64_t tree::encoded_bits(fcounter const& fc) const {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < ALPH_SIZE; ++i) {
+        auto const& f = fc.freq()[i];
+        uint64_t len = alph_map_.words[(uint8_t) f.symb] & 0xFF;
+        if (f.cnt && !len) {
+            return UINT64_MAX;
+        }
+        bits += f.cnt * len;
+    }
+    return bits;
+}
+
+// a block per pool thread or PARALLEL_CHUNK_SIZE bytes, plus a block per
+// BLOCK_INPUT_MAX bytes; forward input is stored rather than grown, other
+// input can take up to the longest code per byte
+size_t tree::encoded_size_bound(size_t bytes) const {
+    size_t blocks = 1 + std::max<size_t>(thread_pool::instance().size(), bytes / PARALLEL_CHUNK_SIZE)
+            + bytes / BLOCK_INPUT_MAX;
+    size_t bits = std::max<size_t>(8, alph_map_.max_len);
+    return blocks * HEADER_SIZE + (bytes * bits + 7) / 8;
+}
+
 void tree::clear() {
     decoded_.clear();
 }
 
-bitset const& tree::encode(char c) const {
-    return alph_map_[(uint8_t)c];
+bitset tree::encode(char c) const {
+    return alph_map_.get(c);
 }
 
 size_t tree::chars_left() const {
@@ -186,4 +759,57 @@ size_t tree::chars_left() const {
 void tree::trace() const {
     trace_(root);
 }
+
+adaptive_encoder::adaptive_encoder(bool canonical)
+: canonical_(canonical) {}
+
+std::string adaptive_encoder::select_table_(fcounter const& fc, uint64_t bytes, bool& store) {
+    std::unique_ptr<tree> fresh(canonical_ ? new tree(fc, tree::canonical_header()) : new tree(fc));
+    ++clock_;
+    if (tables_.empty()) {
+        store = fresh->encoded_bits(fc) >= 8 * bytes && bytes;
+        tables_.push_back(std::move(fresh));
+        used_.push_back(clock_);
+        return tables_[0]->encode();
+    }
+
+    // a switch costs a table block, a new table also its tree header
+    uint64_t best = fresh->encoded_bits(fc) + 8 * (HEADER_SIZE + fresh->encode().size());
+    size_t pick = tables_.size();
+    for (size_t i = 0; i < tables_.size(); ++i) {
+        uint64_t bits = tables_[i]->encoded_bits(fc);
+        if (bits == UINT64_MAX) {
+            continue;
+        }
+        bits += i == current_ ? 0 : 8 * HEADER_SIZE;
+        if (bits < best) {
+            best = bits;
+            pick = i;
+        }
+    }
+
+    if (best >= 8 * bytes && bytes) {
+        store = true;
+        return std::string();
+    }
+    if (pick < tables_.size()) {
+        used_[pick] = clock_;
+        if (pick == current_) {
+            return std::string();
+        }
+        current_ = pick;
+        return tree::encode_table_ref((uint32_t) pick);
+    }
+    if (tables_.size() < MAX_TABLES) {
+        tables_.push_back(nullptr);
+        used_.push_back(0);
+        pick = tables_.size() - 1;
+    } else {
+        pick = std::min_element(used_.begin(), used_.end()) - used_.begin();
+    }
+    tables_[pick] = std::move(fresh);
+    used_[pick] = clock_;
+    current_ = pick;
+    return tables_[pick]->encode_table((uint32_t) pick);
+}
 } // namespace hfm
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <algorithm>
 #include <iterator>
+#include <memory>
 #include <numeric>
 #include <vector>
 
@@ -42,6 +43,17 @@ public:
 };
 
 class tree {
+public:
+    // one entry per encode(first, last) call: where its blocks start
+    // (relative to the end of the tree header), how many bytes they take
+    // and how many symbols they hold
+    struct index_entry {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t count;
+    };
+
+private:
     struct node {
         size_t f;
         node *l, *r;
@@ -52,13 +64,46 @@ class tree {
     };
     using node_ptr = node*;
 
-    bitset alph_map_[ALPH_SIZE];
+    // one entry of the multi-level decoding table: either a symbol with
+    // its code length, or a link to the subtable for longer codes
+    struct lookup_entry {
+        uint32_t next = 0;
+        uint8_t len = 0;
+        char c = 0;
+    };
+
+    // read position of one bitstream inside a block
+    struct bit_stream {
+        uint8_t const* first;
+        uint8_t const* last;
+        uint64_t buffer = 0;
+        uint32_t bits = 0;
+    };
+
+    code_table alph_map_;
     char char_by_id_[ALPH_SIZE];
     std::string tree_code_;
 
+    // all nodes of the current tree, root included: capacity is reserved
+    // once for the largest possible tree, so node pointers stay valid
+    std::vector<node> nodes_;
     node_ptr root = nullptr;
     node_ptr cur_restore = nullptr;
     std::vector<uint8_t> decoded_;
+    // when set, symbols go straight to [out_, out_end_) instead of decoded_
+    uint8_t* out_ = nullptr;
+    uint8_t* out_end_ = nullptr;
+
+    std::vector<index_entry> index_;
+    uint64_t index_offset = 0;
+
+    std::vector<lookup_entry> lookup_;
+    // decoding tables of the trees restored so far, by table slot
+    std::vector<std::vector<lookup_entry>> tables_;
+    uint32_t table_slot = 0;
+    uint64_t bit_buffer = 0;
+    uint32_t bit_count = 0;
+    uint32_t cur_table = 0;
 
     uint32_t alphabet_restore_left = 0;
     uint32_t alph_id = 0;
@@ -69,19 +114,48 @@ class tree {
     uint32_t hash = 0;
     uint32_t count = 0;
     uint32_t expected_hash = 0;
+    uint32_t block_flags = 0;
+    uint32_t jump_left = 0;
+    uint32_t jump_cnt = 0;
+    uint32_t stream_total = 0;
+    uint32_t streams_left = 0;
+    uint32_t stream_count = 0;
+    uint32_t last_stream_count = 0;
     bool tree_ok = false;
+    bool canonical = false;
 
     static bool less_(node_ptr a, node_ptr b, node_ptr c, node_ptr d);
     void build_tree_(fcounter const& fc);
+    void build_tree_(uint8_t const* lengths);
+    void limit_lengths_(fcounter const& fc, size_t max_len, uint8_t* lengths) const;
     void calc_code_(node_ptr p, bitset& current_code_bitset,
             bitset& tree_alphabet_bitset, bitset& tree_code_bitset, size_t& cnt);
+    static void calc_lengths_(node_ptr p, uint8_t depth, uint8_t* lengths);
+    void canonical_codes_(uint8_t const* lengths);
+    void write_lengths_(uint8_t const* lengths);
+    void write_tree_header_(uint32_t flags);
 
     bool header_initialized_() const;
     void check_block_hash_() const;
 
-    node_ptr decode_(node_ptr v, uint8_t x, uint8_t left);
+    void build_lookup_();
+    void fill_lookup_(node_ptr p, uint32_t table, uint32_t prefix, uint8_t depth);
+    void insert_lookup_(bitset const& code, char c);
+    void reset_decoding_();
+    void decode_(uint8_t x);
+    void decode_buffered_();
+    bool output_full_() const;
+    uint8_t const* decode_fast_(uint8_t const* first, uint8_t const* last);
+    void start_block_();
+    void start_table_();
+    void read_stream_table_(uint8_t x);
+    char decode_symbol_(bit_stream& s) const;
+    uint8_t const* decode_streams_(uint8_t const* first, uint8_t const* last, uint8_t* out, uint8_t* out_end,
+            uint32_t cnt) const;
+    uint8_t const* decode_block_(uint8_t const* first, uint8_t const* last, uint8_t* out, uint32_t cnt) const;
     void trace_(node_ptr p, size_t d = 0) const;
-    static void terminate_(node_ptr p);
+    node_ptr new_node_(node const& n);
+    void clear_nodes_();
 
     template <typename InputIt>
     InputIt parse_header_(InputIt first, InputIt last) {
@@ -98,15 +172,132 @@ class tree {
             hash = crc32_hash(hash, convert_to_byte(first));
             count += convert_to_byte(first++) << (8 * (header_cnt - HASH_SIZE_BYTES));
         }
+        if (header_initialized_() && tree_ok) {
+            block_flags = count & ~BLOCK_COUNT_MASK;
+            count &= BLOCK_COUNT_MASK;
+            if (block_flags != 0 && block_flags != BLOCK_INDEX_FLAG && block_flags != BLOCK_STREAMS_FLAG
+                    && block_flags != BLOCK_TABLE_FLAG && block_flags != BLOCK_STORED_FLAG) {
+                throw std::runtime_error("corrupted file : unknown block type");
+            }
+            if (block_flags == BLOCK_TABLE_FLAG && (count & ~(TABLE_REF_FLAG | (MAX_TABLES - 1)))) {
+                throw std::runtime_error("corrupted file : bad table block");
+            }
+        }
+        return first;
+    }
+
+    void index_block_(size_t size, uint64_t symbols) {
+        index_.push_back({index_offset, (uint32_t) size, (uint32_t) symbols});
+        index_offset += size;
+    }
+
+    // replaces ret with the blocks written by f for slices of at most
+    // BLOCK_INPUT_MAX bytes, each with an index entry of its own, so that
+    // neither block counts nor index entries overflow
+    template <typename ForwardIt, typename F>
+    void encode_slices_(ForwardIt first, ForwardIt last, std::string& ret, F f, std::forward_iterator_tag) {
+        typedef typename std::iterator_traits<ForwardIt>::value_type value_type;
+
+        size_t dist = std::distance(first, last);
+        size_t max = BLOCK_INPUT_MAX / sizeof(value_type);
+        ret.clear();
+        do {
+            size_t n = std::min(dist, max);
+            auto next = n < dist ? std::next(first, n) : last;
+            size_t start = ret.size();
+            f(first, next, ret);
+            index_block_(ret.size() - start, n * sizeof(value_type));
+            dist -= n;
+            first = next;
+        } while (dist);
+    }
+
+    template <typename InputIt, typename F>
+    void encode_slices_(InputIt first, InputIt last, std::string& ret, F f, std::input_iterator_tag) {
+        typedef typename std::iterator_traits<InputIt>::value_type value_type;
+
+        size_t max = BLOCK_INPUT_MAX / sizeof(value_type);
+        typename bounded_input<InputIt>::state slice {first, last, 0};
+        ret.clear();
+        do {
+            slice.left = max;
+            size_t start = ret.size();
+            f(bounded_input<InputIt>(&slice), bounded_input<InputIt>(), ret);
+            index_block_(ret.size() - start, (max - slice.left) * sizeof(value_type));
+        } while (slice.it != last);
+    }
+
+    template <typename InputIt, typename F>
+    void encode_slices_(InputIt first, InputIt last, std::string& ret, F f) {
+        typedef typename std::iterator_traits<InputIt>::iterator_category category;
+        encode_slices_(first, last, ret, f, category());
+    }
+
+    // contiguous input goes through the bulk decoder first and is hashed
+    // in one go after the run is consumed
+    template <typename InputIt>
+    InputIt decode_run_(InputIt first, InputIt last) {
+        if constexpr (is_contiguous_iterator_v<InputIt>) {
+            auto start = reinterpret_cast<uint8_t const*>(&(*first));
+            size_t used = decode_fast_(start, start + std::distance(first, last)) - start;
+            for (first += used; first != last && count && !output_full_(); ++used) {
+                decode_(convert_to_byte(first++));
+            }
+            hash = crc32_update(hash, start, used);
+        } else if (!output_full_()) {
+            hash = crc32_hash(hash, convert_to_byte(first));
+            decode_(convert_to_byte(first++));
+        }
         return first;
     }
 
+    template <typename InputIt>
+    InputIt copy_run_(InputIt first, InputIt last) {
+        if constexpr (is_contiguous_iterator_v<InputIt>) {
+            auto start = reinterpret_cast<uint8_t const*>(&(*first));
+            auto n = std::min<size_t>(count, std::distance(first, last));
+            if (out_) {
+                n = std::min<size_t>(n, out_end_ - out_);
+                out_ = std::copy(start, start + n, out_);
+            } else {
+                decoded_.insert(decoded_.end(), start, start + n);
+            }
+            hash = crc32_update(hash, start, n);
+            count -= n;
+            return first + n;
+        } else if (!output_full_()) {
+            uint8_t x = convert_to_byte(first++);
+            hash = crc32_hash(hash, x);
+            if (out_) {
+                *out_++ = x;
+            } else {
+                decoded_.push_back(x);
+            }
+            --count;
+        }
+        return first;
+    }
+
+    template <typename InputIt>
+    InputIt skip_run_(InputIt first, InputIt last) {
+        if constexpr (is_contiguous_iterator_v<InputIt>) {
+            auto n = std::min<size_t>(count, std::distance(first, last));
+            hash = crc32_update(hash, reinterpret_cast<uint8_t const*>(&(*first)), n);
+            count -= n;
+            return first + n;
+        } else {
+            hash = crc32_hash(hash, convert_to_byte(first++));
+            --count;
+            return first;
+        }
+    }
+
     template <typename InputIt>
     InputIt restore_tree_(InputIt first, InputIt last) {
         for (; first != last; ++first) {
             for (size_t i = 0; i < 8; ++i) {
                 if (convert_to_byte(first) & (1ull << (7 - i))) {
-                    auto new_node = new node {228, nullptr, nullptr, 0, -1, cur_restore, false};
+                    auto new_node = new_node_({228, nullptr, nullptr, 0, -1, cur_restore, false});
                     cur_restore->l = new_node;
                     cur_restore = cur_restore->l;
                 } else {
@@ -118,7 +309,7 @@ class tree {
                     if (cur_restore == root) {
                         return ++first;
                     } else {
-                        auto new_node = new node {228, nullptr, nullptr, 0, -1, cur_restore->p, true};
+                        auto new_node = new_node_({228, nullptr, nullptr, 0, -1, cur_restore->p, true});
                         cur_restore = cur_restore->p;
                         cur_restore->r = new_node;
                         cur_restore = cur_restore->r;
@@ -137,6 +328,26 @@ class tree {
         return first;
     }
 
+    // lengths are run-length coded: a byte with the high bit set stands for
+    // (b & 0x7F) + 1 absent symbols, any other byte is a code length;
+    // symbols past the end of the table are absent
+    template <typename InputIt>
+    void restore_lengths_(InputIt first, InputIt last) {
+        uint8_t lengths[ALPH_SIZE] = {};
+        for (size_t i = 0; first != last; ++first) {
+            uint8_t b = convert_to_byte(first);
+            size_t run = (b & 0x80) ? (b & 0x7F) + 1 : 1;
+            if (i + run > ALPH_SIZE) {
+                throw std::runtime_error("corrupted file : code lengths overflow alphabet");
+            }
+            if (!(b & 0x80)) {
+                lengths[i] = b;
+            }
+            i += run;
+        }
+        canonical_codes_(lengths);
+    }
+
     template <typename InputIt>
     InputIt initialize_tree_(InputIt first, InputIt last) {
         if (tree_ok || (header_initialized_() && !header_cnt) || first == last) {
@@ -147,14 +358,16 @@ class tree {
             if (header_initialized_()) {
                 tree_code_ = std::string(HEADER_SIZE, '\0');
                 write_binary_(count, tree_code_.begin() + HASH_SIZE_BYTES);
+                canonical = count & CANONICAL_FLAG;
+                count &= ~CANONICAL_FLAG;
                 alph_id = vertex_id = 0;
-                terminate_(root);
-                root = new node {0, nullptr, nullptr};
+                clear_nodes_();
+                root = canonical ? nullptr : new_node_({0, nullptr, nullptr});
                 cur_restore = root;
                 alphabet_restore_left = 0;
             }
         }
-        if (first == last) {
+        if (!header_initialized_()) {
             return first;
         }
         while (first != last && count) {
@@ -168,21 +381,80 @@ class tree {
                 throw std::runtime_error("corrupted file : incorrect tree hash sum");
             }
 
-            auto st = restore_tree_(tree_code_.begin() + HEADER_SIZE, tree_code_.end());
-            restore_alphabet_(st, tree_code_.end());
+            if (canonical) {
+                restore_lengths_(tree_code_.begin() + HEADER_SIZE, tree_code_.end());
+            } else {
+                auto st = restore_tree_(tree_code_.begin() + HEADER_SIZE, tree_code_.end());
+                restore_alphabet_(st, tree_code_.end());
+                build_lookup_();
+            }
+            if (tables_.size() <= table_slot) {
+                tables_.resize(table_slot + 1);
+            }
+            tables_[table_slot] = lookup_;
             count = header_cnt = hash = expected_hash = 0;
             tree_ok = true;
         }
         return first;
     }
 
+    template <typename InputIt>
+    InputIt prepare_(InputIt first, InputIt last) {
+        first = initialize_tree_(first, last);
+        while (first != last && !output_full_()) {
+            if (!tree_ok) {
+                first = initialize_tree_(first, last);
+            } else if (header_initialized_()) {
+                if (block_flags & BLOCK_TABLE_FLAG) {
+                    start_table_();
+                } else if (jump_left) {
+                    hash = crc32_hash(hash, convert_to_byte(first));
+                    read_stream_table_(convert_to_byte(first++));
+                } else if (!count && streams_left) {
+                    count = --streams_left ? stream_count : last_stream_count;
+                    reset_decoding_();
+                } else if (!count) {
+                    header_cnt = 0;
+                    check_block_hash_();
+                    first = parse_header_(first, last);
+                    start_block_();
+                } else if (block_flags & BLOCK_INDEX_FLAG) {
+                    first = skip_run_(first, last);
+                } else if (block_flags & BLOCK_STORED_FLAG) {
+                    first = copy_run_(first, last);
+                } else {
+                    first = decode_run_(first, last);
+                }
+            } else {
+                first = parse_header_(first, last);
+                start_block_();
+            }
+        }
+        return first;
+    }
+
 public:
+    // every policy starts a new block at least every BLOCK_INPUT_MAX bytes
     struct encoding_policy {};
     struct single_block : encoding_policy {};
     struct any_block : encoding_policy {};
+    // the input is kept as it is, for data the code would not shrink
+    struct stored_block : encoding_policy {};
+    // every block is split into groups of STREAM_CNT streams that
+    // decode_blocks walks at once; large blocks get a group per pool
+    // thread and are encoded in parallel
+    struct multi_stream : encoding_policy {};
+
+    struct header_policy {};
+    struct tree_header : header_policy {};
+    struct canonical_header : header_policy {};
 
     tree() = default;
-    explicit tree(fcounter const& fcc);
+    // max_len caps the code length (0 for no limit), the code stays
+    // optimal among the codes that respect the cap
+    explicit tree(fcounter const& fcc, size_t max_len = 0);
+    tree(fcounter const& fcc, tree_header, size_t max_len = 0);
+    tree(fcounter const& fcc, canonical_header, size_t max_len = 0);
     tree& operator=(tree const&) = delete;
     tree(tree const&) = delete;
     ~tree();
@@ -194,20 +466,69 @@ public:
     bool read_finished_success() const;
 
     std::string const& encode() const;
-    bitset const& encode(char c) const;
-
-    template <typename InputIt>
-    std::string encode(any_block, InputIt first, InputIt last) {
+    bitset encode(char c) const;
+    std::string encode_index() const;
+    // forgets the index entries of the blocks encoded so far, for output
+    // that is written without an index
+    void drop_index();
+    // a table block followed by the tree header: switches a decoder that
+    // is in the middle of a stream to this tree, for the blocks after it,
+    // and keeps the tree in the given slot (the stream header fills slot 0)
+    std::string encode_table(uint32_t slot = 0) const;
+    // a table block switching back to the tree kept in slot
+    static std::string encode_table_ref(uint32_t slot);
+    // size of the symbols counted by fc in this code, UINT64_MAX if some
+    // of them have no code
+    uint64_t encoded_bits(fcounter const& fc) const;
+
+    // upper bound of the size of encode(policy, first, last) for input of
+    // the given size in bytes, under any policy and the current pool size
+    size_t encoded_size_bound(size_t bytes) const;
+
+    template <typename Policy, typename InputIt>
+    std::enable_if_t<std::is_base_of_v<encoding_policy, Policy>, std::string> encode(Policy, InputIt first, InputIt last) {
         std::string ret;
-        parallel_encode(first, last, ret, alph_map_);
+        encode(Policy(), first, last, ret);
         return ret;
     }
 
+    template <typename Policy, typename InputIt>
+    std::enable_if_t<std::is_base_of_v<encoding_policy, Policy>> encode(Policy, InputIt first, InputIt last,
+            std::string& ret) {
+        encode_scratch scratch;
+        encode(Policy(), first, last, ret, scratch);
+    }
+
+    // the encoded blocks replace the contents of ret, reusing its storage;
+    // scratch keeps the parts encoded in parallel. Once ret and scratch
+    // have grown to the block size, encoding allocates no more output
+    // memory; one scratch may serve any number of trees.
     template <typename InputIt>
-    std::string encode(single_block, InputIt first, InputIt last) {
-        std::string ret;
-        encode_impl(first, last, ret, alph_map_);
-        return ret;
+    void encode(any_block, InputIt first, InputIt last, std::string& ret, encode_scratch& scratch) {
+        encode_slices_(first, last, ret, [this, &scratch](auto first, auto last, std::string& ret) {
+            parallel_encode(first, last, ret, alph_map_, scratch);
+        });
+    }
+
+    template <typename InputIt>
+    void encode(single_block, InputIt first, InputIt last, std::string& ret, encode_scratch&) {
+        encode_slices_(first, last, ret, [this](auto first, auto last, std::string& ret) {
+            encode_or_store_impl(first, last, ret, alph_map_);
+        });
+    }
+
+    template <typename InputIt>
+    void encode(stored_block, InputIt first, InputIt last, std::string& ret, encode_scratch&) {
+        encode_slices_(first, last, ret, [](auto first, auto last, std::string& ret) {
+            store_impl(first, last, ret);
+        });
+    }
+
+    template <typename InputIt>
+    void encode(multi_stream, InputIt first, InputIt last, std::string& ret, encode_scratch& scratch) {
+        encode_slices_(first, last, ret, [this, &scratch](auto first, auto last, std::string& ret) {
+            parallel_encode_streams(first, last, ret, alph_map_, scratch);
+        });
     }
 
     template <typename InputIt>
@@ -217,25 +538,48 @@ public:
 
     template <typename InputIt>
     void prepare(InputIt first, std::enable_if_t<carries_byte_data_v<InputIt>, InputIt> last) {
-        first = initialize_tree_(first, last);
-        while (first != last) {
-            if (header_initialized_()) {
-                if (!count) {
-                    header_cnt = 0;
-                    check_block_hash_();
-                    first = parse_header_(first, last);
-                    cur_restore = root;
-                } else {
-                    hash = crc32_hash(hash, convert_to_byte(first));
-                    cur_restore = decode_(cur_restore, convert_to_byte(first++), 8);
-                }
-            } else {
-                first = parse_header_(first, last);
-                cur_restore = root;
+        prepare_(first, last);
+    }
+
+    struct decode_result {
+        size_t consumed;
+        size_t produced;
+    };
+
+    // streaming decode without staging, in the manner of zlib's
+    // next_in/avail_out: decodes [first, last) straight into
+    // [out, out + avail) and stops once either side runs out; the input
+    // not consumed must be passed again, symbols already read but not
+    // yet written come out of the next call. Output staged by prepare()
+    // must be taken with decode() and clear() first.
+    template <typename ForwardIt>
+    decode_result decode(ForwardIt first, std::enable_if_t<carries_byte_data_v<ForwardIt>, ForwardIt> last,
+            void* out, size_t avail) {
+        if (!avail) {
+            return {0, 0};
+        }
+        out_ = static_cast<uint8_t*>(out);
+        out_end_ = out_ + avail;
+        try {
+            // symbols left over from a call that ran out of output space
+            if (bit_count) {
+                decode_buffered_();
             }
+            auto next = prepare_(first, last);
+            decode_result ret {(size_t) std::distance(first, next), (size_t) (out_ - static_cast<uint8_t*>(out))};
+            out_ = out_end_ = nullptr;
+            return ret;
+        } catch (...) {
+            out_ = out_end_ = nullptr;
+            throw;
         }
     }
 
+    // decodes the whole blocks in [first, last), e.g. a range described by
+    // an index entry, into [out, out_end); does not touch the streaming
+    // state and may be called from several threads at once
+    uint8_t* decode_blocks(uint8_t const* first, uint8_t const* last, uint8_t* out, uint8_t* out_end) const;
+
     template <typename OutputIt>
     OutputIt decode(OutputIt first, std::enable_if_t<carries_trivially_copyable_v<OutputIt>, OutputIt> last) {
         typedef typename std::iterator_traits<OutputIt>::value_type value_type;
@@ -254,6 +598,53 @@ public:
         return first;
     }
 };
+
+// Picks the code table per block: a block is encoded with whichever of
+// the tables written so far, or a new one built for it, gives the
+// shortest output, and is preceded by a table block whenever that is not
+// the table in use. Up to MAX_TABLES tables are kept, the least recently
+// used one gives way to a new one. Blocks that no table would shrink are
+// stored as they are.
+class adaptive_encoder {
+    std::vector<std::unique_ptr<tree>> tables_;
+    std::vector<uint64_t> used_;
+    size_t current_ = 0;
+    uint64_t clock_ = 0;
+    bool canonical_;
+    std::string block_;
+    // shared by all the tables, so that memory does not grow with them
+    encode_scratch scratch_;
+
+    std::string select_table_(fcounter const& fc, uint64_t bytes, bool& store);
+
+public:
+    explicit adaptive_encoder(bool canonical = false);
+
+    // the first call also writes the stream header; the output replaces
+    // the contents of ret, reusing its storage
+    template <typename ForwardIt>
+    void encode(ForwardIt first, ForwardIt last, std::string& ret) {
+        typedef typename std::iterator_traits<ForwardIt>::value_type value_type;
+
+        fcounter fc;
+        fc.update(first, last);
+        bool store = false;
+        ret.assign(select_table_(fc, std::distance(first, last) * sizeof(value_type), store));
+        if (store) {
+            tables_[current_]->encode(tree::stored_block(), first, last, block_, scratch_);
+        } else {
+            tables_[current_]->encode(tree::multi_stream(), first, last, block_, scratch_);
+        }
+        ret += block_;
+    }
+
+    template <typename ForwardIt>
+    std::string encode(ForwardIt first, ForwardIt last) {
+        std::string ret;
+        encode(first, last, ret);
+        return ret;
+    }
+};
 } // namespace hfm
 
 #endif // HUFFMAN_ENCODER_H_
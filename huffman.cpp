@@ -7,15 +7,35 @@
 #include <sstream>
 #include <vector>
 #include <any>
+#include <filesystem>
 #include <fstream>
+#include <cstring>
+#include <charconv>
+#include <system_error>
 
 #include "encoder.hpp"
+#include "archive.hpp"
 #include "bitset.hpp"
+#include "mapped_file.hpp"
+#include "pipeline.hpp"
+#include "uring_file.hpp"
 
 #define BUFF_SIZE 128000
 #define BIG_BUFF_SIZE 4096000
 
 static bool verbose = false;
+static bool canonical = false;
+static bool write_index = true;
+static bool single_pass = false;
+static bool range = false;
+static uint64_t range_offset = 0, range_length = 0;
+enum class io_backend { stream, mmap, uring };
+static io_backend io = io_backend::stream;
+static bool direct_io = false;
+// messages go to stderr while the output is stdout, the progress bar is
+// off while the input size is unknown
+static std::ostream* console = &std::cout;
+static bool progress = true;
 char const ok_status[] = "\033[32m[  OK  ] \033[0m";
 char const fail_status[] = "\033[31m[ FAIL ] \033[0m";
 static char status[51] = "\033[01;34m[RUN...] \033[0m[                    ] 00.00%";
@@ -24,13 +44,19 @@ const size_t start_ind = 22, end_ind = 42;
 const size_t perc_pos = 44;
 
 void status_remove() {
+    if (!progress) {
+        return;
+    }
     for (size_t i = 0; i < status_size; ++i) {
-        std::cout << '\b';
+        *console << '\b';
     }
-    std::cout << std::flush;
+    *console << std::flush;
 }
 
 void show_status(float perc) {
+    if (!progress) {
+        return;
+    }
     auto parts = (size_t) (20.0f * perc);
     status_remove();
     for (size_t i = start_ind; i < end_ind; ++i) {
@@ -41,7 +67,7 @@ void show_status(float perc) {
     for (size_t i = 0; i <= 3 + (perc >= 10.f); ++i) {
         status[i + perc_pos + 1 - (perc >= 10.f)] = num[i];
     }
-    std::cout << status << std::flush;
+    *console << status << std::flush;
 }
 
 struct Deleter {
@@ -50,13 +76,168 @@ struct Deleter {
     }
 };
 
+// buffer passed between pipeline stages, keeps its storage
+struct chunk {
+    std::vector<char> data;
+    size_t size = 0;
+};
+
+// "-" is stdin or stdout
+bool is_std(char const* path) {
+    return std::strcmp(path, "-") == 0;
+}
+
+// buffer of an input or output file: io_uring with --io uring, std::filebuf
+// otherwise or when io_uring or the file doesn't allow it
+std::shared_ptr<std::streambuf> open_file(char const* path, bool out) {
+    if (is_std(path)) {
+        return std::shared_ptr<std::streambuf>(out ? std::cout.rdbuf() : std::cin.rdbuf(), [](std::streambuf*) {});
+    }
+    if (io == io_backend::uring) {
+        try {
+            if (out) {
+                return std::make_shared<hfm::uring_writer>(path, direct_io);
+            }
+            return std::make_shared<hfm::uring_reader>(path, direct_io);
+        } catch (std::system_error const& e) {
+            if (verbose) {
+                *console << "io_uring unavailable (" << e.what() << "), using streams\n";
+            }
+        }
+    }
+    auto fb = std::make_shared<std::filebuf>();
+    if (!fb->open(path, out ? std::ios::out | std::ios::trunc | std::ios::binary : std::ios::in | std::ios::binary)) {
+        throw std::runtime_error(out ? "failed to open output file" : "failed to open input file");
+    }
+    return fb;
+}
+
+void close_file(std::ostream& out) {
+    if (!out.flush()) {
+        throw std::runtime_error("failed to write output file");
+    }
+}
+
+// reads the next BIG_BUFF_SIZE chunk, false at the end of the input
+// (an empty input still gives one empty chunk)
+bool read_chunk(std::istream& in, chunk& c, bool& head) {
+    c.data.resize(BIG_BUFF_SIZE);
+    in.read(c.data.data(), BIG_BUFF_SIZE);
+    if (in.bad()) {
+        throw std::runtime_error("failed to read input file");
+    }
+    c.size = in.gcount();
+    bool more = c.size || head;
+    head = false;
+    return more;
+}
+
+// reads the input once: every BIG_BUFF_SIZE chunk is encoded with the
+// table that suits it best, a new one or one of those written before;
+// used for pipes and other inputs that can't be read twice
+void encode_single_pass(char const *in_file, char const *out_file) {
+    auto in = open_file(in_file, false);
+    std::istream file(in.get());
+    auto out = open_file(out_file, true);
+    std::ostream ofs(out.get());
+
+    size_t count = 0;
+    auto stp = std::chrono::high_resolution_clock::now();
+
+    hfm::adaptive_encoder enc(canonical);
+    bool head = true;
+    hfm::run_pipeline<chunk, std::string>(PIPELINE_DEPTH,
+        [&](chunk& c) {
+            return read_chunk(file, c, head);
+        },
+        [&](chunk& c, std::string& code) {
+            enc.encode(c.data.data(), c.data.data() + c.size, code);
+            count += c.size;
+        },
+        [&](std::string& code) {
+            ofs.write(code.data(), code.size());
+        });
+    close_file(ofs);
+
+    if (verbose) {
+        std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - stp;
+        *console << "average encoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
+        *console << "symbols encoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
+    }
+}
+
+// encodes from a mapping of the input, the blocks of every chunk are
+// copied into a mapping of the output; the output is created with room
+// for the worst case and cut to the written size afterwards
+void encode_mapped(char const *in_file, char const *out_file) {
+    hfm::mapped_input in(in_file);
+    uint8_t const* data = in.data();
+    size_t count = in.size();
+
+    auto stp = std::chrono::high_resolution_clock::now();
+    hfm::fcounter fc;
+    fc.update(data, data + count);
+    std::unique_ptr<hfm::tree> ht(canonical
+            ? new hfm::tree(fc, hfm::tree::canonical_header())
+            : new hfm::tree(fc));
+
+    auto const& header = ht->encode();
+    size_t chunks = std::max<size_t>(1, (count + BIG_BUFF_SIZE - 1) / BIG_BUFF_SIZE);
+    size_t bound = header.size() + chunks * ht->encoded_size_bound(BIG_BUFF_SIZE)
+            + HEADER_SIZE + chunks * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    hfm::mapped_output out(out_file, bound);
+    char* pos = std::copy(header.begin(), header.end(), reinterpret_cast<char*>(out.data()));
+    bool store = count && ht->encoded_bits(fc) >= 8 * count;
+
+    std::string code;
+    encode_scratch scratch;
+    size_t first = 0;
+    do {
+        size_t last = std::min(count, first + BIG_BUFF_SIZE);
+        if (store) {
+            ht->encode(hfm::tree::stored_block(), data + first, data + last, code, scratch);
+        } else {
+            ht->encode(hfm::tree::multi_stream(), data + first, data + last, code, scratch);
+        }
+        pos = std::copy(code.begin(), code.end(), pos);
+        show_status(count ? 1.0f * last / count : 1.0f);
+        ht->clear();
+        first = last;
+    } while (first < count);
+    if (write_index) {
+        auto index = ht->encode_index();
+        pos = std::copy(index.begin(), index.end(), pos);
+    }
+    out.finish(pos - reinterpret_cast<char*>(out.data()));
+    status_remove();
+
+    if (verbose) {
+        std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - stp;
+        *console << "average encoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
+        *console << "symbols encoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
+    }
+    show_status(1.0f);
+}
+
 void encode_file(char const *in_file, char const *out_file) {
-    std::ifstream file;
-    file.open(in_file, std::ifstream::binary);
-    if (!file) {
-        throw std::runtime_error("failed to open input file");
+    if (single_pass || is_std(in_file) || !std::filesystem::is_regular_file(in_file)) {
+        encode_single_pass(in_file, out_file);
+        return;
+    }
+    if (io == io_backend::mmap && !is_std(out_file)) {
+        try {
+            encode_mapped(in_file, out_file);
+            return;
+        } catch (std::system_error const& e) {
+            if (verbose) {
+                *console << "mapped io unavailable (" << e.what() << "), using streams\n";
+            }
+        }
     }
 
+    auto in = open_file(in_file, false);
+    std::istream file(in.get());
+
     hfm::fcounter fc;
 
     auto buff = static_cast<char*>(operator new(BIG_BUFF_SIZE));
@@ -70,101 +251,208 @@ void encode_file(char const *in_file, char const *out_file) {
         fc.update(buff, buff + file.gcount());
         count += file.gcount();
     }
-    file.close();
 
     std::chrono::duration<double> counter_duration = std::chrono::high_resolution_clock::now() - stp;
-    std::cout << "updating speed = " << 1.0f * count / counter_duration.count() / 1000000.0f << " Mb/sec\n";
+    *console << "updating speed = " << 1.0f * count / counter_duration.count() / 1000000.0f << " Mb/sec\n";
     stp = std::chrono::high_resolution_clock::now();
 
-    hfm::tree ht(fc);
+    std::unique_ptr<hfm::tree> ht(canonical
+            ? new hfm::tree(fc, hfm::tree::canonical_header())
+            : new hfm::tree(fc));
 
-    file.open(in_file);
-    if (!file) {
-        throw std::runtime_error("failed to open input file");
-    }
-    std::ofstream ofs;
-    ofs.open(out_file);
-    if (!ofs) {
-        throw std::runtime_error("failed to open output file");
-    }
+    file.clear();
+    file.seekg(0, file.beg);
+    auto out = open_file(out_file, true);
+    std::ostream ofs(out.get());
 
-    auto code = ht.encode();
+    auto code = ht->encode();
     ofs.write(code.data(), code.size());
-    code.clear();
+    // the code would not shrink the input, e.g. already compressed data
+    bool store = count && ht->encoded_bits(fc) >= 8 * count;
 
     size_t ncount = 0;
-
-    while (!file.eof()) {
-        file.read(buff, BIG_BUFF_SIZE);
-        ncount += file.gcount();
-        code = ht.encode(buff, buff + file.gcount());
+    bool head = true;
+    encode_scratch scratch;
+    // reading, encoding and writing of consecutive chunks overlap
+    hfm::run_pipeline<chunk, std::string>(PIPELINE_DEPTH,
+        [&](chunk& c) {
+            return read_chunk(file, c, head);
+        },
+        [&](chunk& c, std::string& code) {
+            ncount += c.size;
+            if (store) {
+                ht->encode(hfm::tree::stored_block(), c.data.data(), c.data.data() + c.size, code, scratch);
+            } else {
+                ht->encode(hfm::tree::multi_stream(), c.data.data(), c.data.data() + c.size, code, scratch);
+            }
+            show_status(count ? 1.0f * ncount / count : 1.0f);
+            ht->clear();
+        },
+        [&](std::string& code) {
+            ofs.write(code.data(), code.size());
+        });
+    if (write_index) {
+        code = ht->encode_index();
         ofs.write(code.data(), code.size());
-        show_status(1.0f * ncount / count);
-        code.clear();
-        ht.clear();
     }
     status_remove();
 
     if (verbose) {
         std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - stp;
-        std::cout << "average encoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
-        std::cout << "symbols encoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
+        *console << "average encoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
+        *console << "symbols encoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
     }
 
-    file.close();
-    ofs.close();
+    close_file(ofs);
 
     show_status(1.0f);
 }
 
-void decode_file(char const *in_file, char const *out_file) {
-    std::ifstream file;
-    std::ofstream ofs;
+// decodes from a mapping of the input; an indexed stream is decoded in
+// parallel straight into a mapping of the output
+void decode_mapped(char const *in_file, char const *out_file) {
+    hfm::mapped_input in(in_file);
+    size_t count = 0;
+    auto stp = std::chrono::high_resolution_clock::now();
+
+    hfm::archive arch(in.data(), in.size());
+    if (arch.indexed() && !range) {
+        hfm::mapped_output out(out_file, arch.size());
+        arch.decode(out.data());
+        out.finish(arch.size());
+        count = arch.size();
+    } else {
+        std::ofstream ofs;
+        ofs.open(out_file, std::ofstream::binary);
+        if (!ofs) {
+            throw std::runtime_error("failed to open output file");
+        }
+        if (range) {
+            arch.decode_range(range_offset, range_length, ofs);
+            count = range_length;
+        } else {
+            char out[BUFF_SIZE];
+            hfm::tree ht;
+            uint8_t const* first = in.data();
+            uint8_t const* last = in.data() + in.size();
+            hfm::tree::decode_result r;
+            do {
+                r = ht.decode(first, last, out, BUFF_SIZE);
+                first += r.consumed;
+                ofs.write(out, r.produced);
+            } while (first != last || r.produced == BUFF_SIZE);
+            if (!ht.read_finished_success()) {
+                throw std::runtime_error("decode failed");
+            }
+            count = in.size();
+        }
+        close_file(ofs);
+    }
+    status_remove();
+
+    if (verbose) {
+        std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - stp;
+        *console << "average decoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
+        *console << "symbols decoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
+    }
+    show_status(1.0f);
+}
 
-    file.open(in_file);
-    if (!file) {
-        throw std::runtime_error("failed to open input file");
+void decode_file(char const *in_file, char const *out_file) {
+    // pipes are decoded front to back, without the index
+    bool seekable = !is_std(in_file) && std::filesystem::is_regular_file(in_file);
+    if (range && !seekable) {
+        throw std::runtime_error("--range needs a seekable input");
     }
-    if (!ofs) {
-        throw std::runtime_error("failed to open output file");
+    if (io == io_backend::mmap && seekable && !is_std(out_file)) {
+        try {
+            decode_mapped(in_file, out_file);
+            return;
+        } catch (std::system_error const& e) {
+            if (verbose) {
+                *console << "mapped io unavailable (" << e.what() << "), using streams\n";
+            }
+        }
     }
+    auto in = open_file(in_file, false);
+    std::istream file(in.get());
+    auto out = open_file(out_file, true);
+    std::ostream ofs(out.get());
 
-    file.seekg (0, file.end);
-    size_t length = file.tellg();
-    file.seekg (0, file.beg);
-    ofs.open(out_file);
+    size_t length = 0;
+    std::unique_ptr<hfm::archive> arch;
+    if (seekable) {
+        file.seekg(0, file.end);
+        length = file.tellg();
+        file.seekg(0, file.beg);
+        arch.reset(new hfm::archive(file));
+    }
 
-    char buff[std::max(BUFF_SIZE << 3, 1000)];
-    hfm::tree ht;
     size_t count = 0;
     auto stp = std::chrono::high_resolution_clock::now();
 
-    while (!file.eof()) {
-        file.read(buff, BUFF_SIZE);
-        ht.prepare(buff, buff + file.gcount());
-        ht.decode(buff, buff + ht.chars_left());
-        ofs.write(buff, ht.chars_left());
-        show_status(1.0f * count / length);
-        ht.clear();
-        count += file.gcount();
-    }
-    if (!ht.read_finished_success()) {
-        throw std::runtime_error("decode failed");
+    if (range) {
+        arch->decode_range(range_offset, range_length, ofs);
+        count = range_length;
+    } else if (arch && arch->indexed()) {
+        arch->decode(ofs);
+        count = arch->size();
+    } else {
+        if (arch) {
+            file.clear();
+            file.seekg(0, file.beg);
+        }
+
+        hfm::tree ht;
+        bool head = true;
+        // reading, decoding and writing of consecutive chunks overlap
+        hfm::run_pipeline<chunk, chunk>(PIPELINE_DEPTH,
+            [&](chunk& c) {
+                return read_chunk(file, c, head);
+            },
+            [&](chunk& c, chunk& out) {
+                char const* first = c.data.data();
+                char const* last = first + c.size;
+                hfm::tree::decode_result r;
+                out.size = 0;
+                do {
+                    if (out.data.size() < out.size + BUFF_SIZE) {
+                        out.data.resize(2 * out.data.size() + BUFF_SIZE);
+                    }
+                    r = ht.decode(first, last, out.data.data() + out.size, BUFF_SIZE);
+                    first += r.consumed;
+                    out.size += r.produced;
+                } while (first != last || r.produced == BUFF_SIZE);
+                show_status(length ? 1.0f * count / length : 1.0f);
+                count += c.size;
+            },
+            [&](chunk& out) {
+                ofs.write(out.data.data(), out.size);
+            });
+        if (!ht.read_finished_success()) {
+            throw std::runtime_error("decode failed");
+        }
     }
     status_remove();
 
     if (verbose) {
         std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - stp;
-        std::cout << "average decoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
-        std::cout << "symbols decoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
+        *console << "average decoding speed : " << (size_t) (1.0f * count / dur.count()) / 1000000.0f << " Mb/sec\n";
+        *console << "symbols decoded : " << count << '\n' << "time elapsed : " << dur.count() << '\n';
     }
 
-    file.close();
-    ofs.close();
+    close_file(ofs);
 
     show_status(1.0f);
 }
 
+// a whole unsigned decimal argument, false for anything else
+bool parse_number(char const* s, uint64_t& value) {
+    char const* end = s + std::strlen(s);
+    auto [p, ec] = std::from_chars(s, end, value);
+    return ec == std::errc() && p == end;
+}
+
 int main(int argc, char *argv[]) {
     int i = 1;
     bool compress = false, decompress = false;
@@ -177,16 +465,58 @@ int main(int argc, char *argv[]) {
             decompress = true;
         } else if (args.back() == "--verbose") {
             verbose = true;
+        } else if (args.back() == "--canonical") {
+            canonical = true;
+        } else if (args.back() == "--no-index") {
+            write_index = false;
+        } else if (args.back() == "--single-pass") {
+            single_pass = true;
+        } else if (args.back() == "--range" && i + 2 < argc) {
+            range = true;
+            if (!parse_number(argv[i + 1], range_offset) || !parse_number(argv[i + 2], range_length)) {
+                i = argc;
+                break;
+            }
+            i += 2;
+        } else if (args.back() == "--io" && i + 1 < argc) {
+            std::string name(argv[++i]);
+            if (name == "stream") {
+                io = io_backend::stream;
+            } else if (name == "mmap") {
+                io = io_backend::mmap;
+            } else if (name == "uring") {
+                io = io_backend::uring;
+            } else {
+                std::cerr << "unknown io backend : " << name << '\n';
+                return 1;
+            }
+        } else if (args.back() == "--direct") {
+            direct_io = true;
+        } else if (args.back() == "--threads" && i + 1 < argc) {
+            uint64_t threads;
+            if (!parse_number(argv[++i], threads) || !threads) {
+                i = argc;
+                break;
+            }
+            thread_pool::resize(threads);
         } else {
             break;
         }
     }
     if (i >= argc || ((compress && decompress) || (!compress && !decompress))) {
-        std::cerr << "usage : huffman <args...> <in> [out = out.txt], possible args : -c, -dc (either), --verbose\n";
-        return 0;
+        std::cerr << "usage : huffman <args...> <in> [out = out.txt] (- for stdin / stdout), possible args : -c, -dc (either), --verbose, --canonical, --no-index, --single-pass, --range <offset> <length> (with -dc), --threads <count>, --io <stream|mmap|uring>, --direct (with --io uring)\n";
+        return 1;
     }
     std::string input_file(argv[i]);
     std::string output_file(i + 1 < argc ? argv[i + 1] : (compress ? "out.hfm" : "out.txt"));
+    if (output_file == "-") {
+        console = &std::cerr;
+    }
+    std::error_code ec;
+    if (input_file == "-" || !std::filesystem::is_regular_file(input_file, ec)) {
+        progress = false;
+    }
+    std::ios::sync_with_stdio(false);
     try {
         if (compress) {
             encode_file(input_file.c_str(), output_file.c_str());
@@ -194,10 +524,11 @@ int main(int argc, char *argv[]) {
             decode_file(input_file.c_str(), output_file.c_str());
         }
         status_remove();
-        std::cout << ok_status << '\n';
+        *console << ok_status << '\n';
     } catch (std::exception const& e) {
         status_remove();
-        std::cout << fail_status << " : " << e.what() << '\n';
+        *console << fail_status << " : " << e.what() << '\n';
+        return 1;
     }
     return 0;
 }
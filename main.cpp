@@ -8,11 +8,21 @@
 #include <vector>
 #include <fstream>
 #include <cstring>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "testing.hpp"
 
 #include "encoder.hpp"
+#include "archive.hpp"
+#include "stream.hpp"
+#include "mapped_file.hpp"
+#include "pipeline.hpp"
+#include "uring_file.hpp"
 #include "bitset.hpp"
+#include "bitwriter.hpp"
+#include "threadpool.hpp"
 #include "util.hpp"
 
 #define BUFF_SIZE 4096000
@@ -156,6 +166,50 @@ void complex_bitset_test() {
     }
 }
 
+void bit_writer_test() {
+    for (size_t nt = 0; nt < 100; ++nt) {
+        bitset expected;
+        std::string written;
+        bit_writer bw(written);
+        for (size_t i = 0; i < 1000; ++i) {
+            bitset code = gen_bitset(1 + rnd.rand() % 80);
+            expected.append(code);
+            bw.reserve(code.size());
+            if (code.size() > PACKED_CODE_BITS) {
+                bw.put(code);
+                continue;
+            }
+            uint64_t word = 0;
+            for (size_t j = 0; j < code.size(); ++j) {
+                word = (word << 1) | code[j];
+            }
+            bw.put(word, code.size());
+        }
+        bw.finish();
+        test::check_equal(std::string(expected.begin(), expected.end()), written);
+    }
+}
+
+void code_table_test() {
+    code_table table;
+    bitset codes[ALPH_SIZE];
+    for (size_t c = 0; c < ALPH_SIZE; ++c) {
+        codes[c] = gen_bitset(1 + rnd.rand() % 100);
+        table.assign(c, codes[c]);
+    }
+    for (size_t c = 0; c < ALPH_SIZE; ++c) {
+        test::check_equal(table.get(c).to_string(), codes[c].to_string());
+    }
+
+    std::string s = gen_string(10000), code;
+    bitset expected;
+    for (char c : s) {
+        expected.append(codes[(uint8_t)c]);
+    }
+    encode_impl(s.begin(), s.end(), code, table);
+    test::check_equal(code.substr(HEADER_SIZE), std::string(expected.begin(), expected.end()));
+}
+
 template<typename InputIt>
 void test_fcounter(hfm::fcounter &fc, hfm::fcounter::smb *freq,
                    InputIt first, InputIt last) {
@@ -467,6 +521,860 @@ void megahard_full_tree_test() {
     }
 }
 
+std::string gen_skewed_string(size_t alph) {
+    std::string ret;
+    size_t a = 1, b = 1;
+    for (size_t c = 0; c < alph; ++c) {
+        ret.append(a, char('A' + c));
+        b += a;
+        std::swap(a, b);
+    }
+    std::shuffle(ret.begin(), ret.end(), std::mt19937(rnd.rand()));
+    return ret;
+}
+
+void long_code_tree_test() {
+    for (size_t alph = 2; alph < 25; ++alph) {
+        std::string s = gen_skewed_string(alph);
+        test::check_equal(partial_decode(partial_load(s)), s);
+    }
+}
+
+std::string canonical_load(std::string const &s) {
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc, hfm::tree::canonical_header());
+    return ht.encode() + ht.encode(s.begin(), s.end());
+}
+
+void simple_canonical_tree_test() {
+    for (std::string s : {std::string(), std::string("a"), std::string("ab"),
+                          std::string(3, '\0'), std::string("abracadabrac")}) {
+        test::check_equal(partial_decode(canonical_load(s)), s);
+    }
+}
+
+void complex_canonical_tree_test() {
+    for (size_t i = 0; i < 100; ++i) {
+        std::string s = gen_string(10000);
+        test::check_equal(partial_decode(canonical_load(s)), s);
+    }
+    for (size_t alph = 2; alph < 25; ++alph) {
+        std::string s = gen_skewed_string(alph);
+        test::check_equal(partial_decode(canonical_load(s)), s);
+    }
+}
+
+void faulty_canonical_tree_test() {
+    std::string code = canonical_load(gen_string(10000));
+    ++code[rnd.rand() % code.size()];
+    partial_decode(code); // must throw
+}
+
+template <typename Policy>
+void limited_tree_test(Policy policy) {
+    for (size_t alph = 2; alph < 25; ++alph) {
+        std::string s = gen_skewed_string(alph);
+        hfm::fcounter fc;
+        fc.update(s.begin(), s.end());
+        for (size_t max_len : {6, 8, 11, 12, 15}) {
+            if ((1u << max_len) < alph) {
+                continue;
+            }
+            hfm::tree ht(fc, policy, max_len);
+            for (size_t c = 0; c < ALPH_SIZE; ++c) {
+                test::check_equal(true, ht.encode((char)c).size() <= max_len);
+            }
+            std::string code = ht.encode() + ht.encode(s.begin(), s.end());
+            test::check_equal(partial_decode(code), s);
+        }
+    }
+}
+
+void simple_limited_tree_test() {
+    limited_tree_test(hfm::tree::tree_header());
+}
+
+void canonical_limited_tree_test() {
+    limited_tree_test(hfm::tree::canonical_header());
+}
+
+void optimal_limited_tree_test() {
+    // Fibonacci counts 1 1 2 3 5 8: the unlimited code has lengths up to 5
+    // and costs 45 bits, the best codes bounded by 4 and 3 cost 46 and 47
+    std::string s;
+    size_t a = 1, b = 1;
+    for (char c = 'a'; c < 'g'; ++c) {
+        s.append(a, c);
+        b = a + b;
+        a = b - a;
+    }
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    test::check_equal(hfm::tree(fc).encoded_bits(fc), (uint64_t) 45);
+    for (auto [max_len, bits] : {std::pair<size_t, uint64_t>{5, 45}, {4, 46}, {3, 47}}) {
+        hfm::tree limited(fc, max_len), canonical(fc, hfm::tree::canonical_header(), max_len);
+        for (size_t c = 0; c < ALPH_SIZE; ++c) {
+            test::check_equal(true, limited.encode((char)c).size() <= max_len);
+            test::check_equal(true, canonical.encode((char)c).size() <= max_len);
+        }
+        test::check_equal(limited.encoded_bits(fc), bits);
+        test::check_equal(canonical.encoded_bits(fc), bits);
+        test::check_equal(partial_decode(limited.encode() + limited.encode(s.begin(), s.end())), s);
+    }
+}
+
+void oversized_tree_restore_test() {
+    // every 1 bit descends to a new node: far more than any tree can have
+    std::string code(HEADER_SIZE, '\0');
+    code.append(128, '\xFF');
+    write_binary_((uint32_t) (code.size() - HEADER_SIZE), code.begin() + HASH_SIZE_BYTES);
+    write_binary_(crc32(code.begin(), code.end()), code.begin());
+    hfm::tree reht;
+    reht.prepare(code.begin(), code.end()); // must throw
+}
+
+void small_limit_tree_test() {
+    std::string s(256, '\0');
+    std::iota(s.begin(), s.end(), 0);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc, 7); // must throw
+}
+
+std::string indexed_load(std::string const &s) {
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+
+    std::string code = ht.encode();
+    size_t ind = 0;
+
+    while (ind < s.size()) {
+        size_t add = rnd.rand() % (s.size() - ind) % 2280;
+        if (!add) add = 1;
+        code += ht.encode(s.begin() + ind, s.begin() + ind + add);
+        ind += add;
+    }
+    return code + ht.encode_index();
+}
+
+void indexed_decode_test() {
+    std::string s = gen_string(100000);
+    test::check_equal(partial_decode(indexed_load(s)), s);
+}
+
+void archive_decode_test() {
+    for (size_t i = 0; i < 10; ++i) {
+        std::string s = gen_string(100000);
+        std::stringstream in(indexed_load(s)), out;
+        hfm::archive arch(in);
+        test::check_equal(arch.indexed(), true);
+        test::check_equal(arch.size(), (uint64_t) s.size());
+        arch.decode(out);
+        test::check_equal(out.str(), s);
+    }
+}
+
+void large_block_test() {
+    // just over one slice: two blocks with an index entry each, whatever
+    // kind of iterator the input comes through
+    std::string s(BLOCK_INPUT_MAX + 12345, 0);
+    for (size_t i = 0; i < s.size(); ++i) {
+        s[i] = "aaabbcd"[i % 7];
+    }
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode() + ht.encode(hfm::tree::single_block(), s.begin(), s.end());
+    std::string index = ht.encode_index();
+    test::check_equal(index.size(), (size_t) HEADER_SIZE + 2 * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE);
+
+    std::istringstream is(s);
+    is >> std::noskipws;
+    hfm::tree input(fc);
+    std::string input_code = input.encode() + input.encode(hfm::tree::single_block(),
+            std::istream_iterator<char>(is), std::istream_iterator<char>());
+    test::check_equal(input_code == code, true);
+    test::check_equal(input.encode_index() == index, true);
+
+    std::stringstream in(code + index), out;
+    hfm::archive arch(in);
+    test::check_equal(arch.size(), (uint64_t) s.size());
+    arch.decode_range(BLOCK_INPUT_MAX - 100, 200, out);
+    test::check_equal(out.str(), s.substr(BLOCK_INPUT_MAX - 100, 200));
+}
+
+void archive_range_test() {
+    std::string s = gen_string(100000);
+    std::stringstream in(indexed_load(s));
+    hfm::archive arch(in);
+    for (size_t i = 0; i < 100; ++i) {
+        size_t offset = rnd.rand() * 10 % (s.size() + 1);
+        size_t length = rnd.rand() * 10 % (s.size() - offset + 1);
+        std::stringstream out;
+        arch.decode_range(offset, length, out);
+        test::check_equal(out.str(), s.substr(offset, length));
+    }
+}
+
+void archive_bad_range_test() {
+    std::stringstream in(indexed_load(gen_string(1000))), out;
+    hfm::archive arch(in);
+    arch.decode_range(500, 501, out); // must throw
+}
+
+void archive_no_index_test() {
+    std::stringstream in(partial_load(gen_string(10000)));
+    hfm::archive arch(in);
+    test::check_equal(arch.indexed(), false);
+}
+
+void faulty_index_test() {
+    std::string code = indexed_load(gen_string(10000));
+    size_t size = read_binary_<uint32_t>(code.end() - INDEX_TRAILER_SIZE);
+    ++code[code.size() - size + rnd.rand() % (size - sizeof(uint32_t))];
+    std::stringstream in(code), out;
+    hfm::archive arch(in); // must throw
+    arch.decode(out);
+}
+
+template <typename T>
+std::string stream_load(std::vector<T> const &v) {
+    hfm::fcounter fc;
+    fc.update(v.begin(), v.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode();
+    size_t ind = 0;
+    while (ind < v.size()) {
+        size_t add = std::min(v.size() - ind, (size_t) rnd.rand() * 3);
+        code += ht.encode(hfm::tree::multi_stream(), v.begin() + ind, v.begin() + ind + add);
+        ind += add;
+    }
+    return code + ht.encode_index();
+}
+
+template <typename T>
+void multi_stream_test(std::vector<T> const &v) {
+    std::string code = stream_load(v);
+    std::string decoded = partial_decode(code);
+    test::check_equal(decoded.size(), v.size() * sizeof(T));
+    test::check_equal(0, memcmp(decoded.data(), v.data(), decoded.size()));
+
+    std::stringstream in(code), out;
+    hfm::archive arch(in);
+    arch.decode(out);
+    test::check_equal(out.str(), decoded);
+}
+
+void multi_stream_tree_test() {
+    multi_stream_test(gen_vector<char>(300000));
+    multi_stream_test(gen_vector<uint16_t>(300000));
+    multi_stream_test(gen_vector<uint64_t>(300000));
+    struct triple { char a, b, c; };
+    std::vector<triple> t(100000);
+    for (auto &x : t) {
+        x = {char(rnd.rand()), char(rnd.rand()), char(rnd.rand())};
+    }
+    multi_stream_test(t);
+
+    std::string s = gen_skewed_string(24);
+    std::vector<char> v(s.begin(), s.end());
+    test::check_equal(partial_decode(stream_load(v)), s);
+}
+
+// encoding into a reused string, alone or with a caller-owned
+// encode_scratch shared between trees, gives the blocks a fresh string
+// gets, within encoded_size_bound()
+void reusable_encode_test() {
+    std::string s = gen_string(5000000);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree fresh(fc), reused(fc), other(fc);
+    std::string buff;
+    encode_scratch scratch;
+
+    for (size_t len : {s.size(), (size_t) rnd.rand() % s.size(), (size_t) 0}) {
+        auto check = [&](auto policy) {
+            std::string expected = fresh.encode(policy, s.begin(), s.begin() + len);
+            reused.encode(policy, s.begin(), s.begin() + len, buff);
+            test::check_equal(buff, expected);
+            test::check_equal(buff.size() <= reused.encoded_size_bound(len), true);
+            // one scratch for several trees
+            reused.encode(policy, s.begin(), s.begin() + len, buff, scratch);
+            test::check_equal(buff, expected);
+            other.encode(policy, s.begin(), s.begin() + len, buff, scratch);
+            test::check_equal(buff, expected);
+        };
+        check(hfm::tree::any_block());
+        check(hfm::tree::single_block());
+        check(hfm::tree::stored_block());
+        check(hfm::tree::multi_stream());
+    }
+
+    char const* storage = buff.data();
+    reused.encode(hfm::tree::multi_stream(), s.begin(), s.begin() + 100000, buff, scratch);
+    test::check_equal(buff.data() == storage, true);
+
+    std::istringstream in(s.substr(0, 100000));
+    in >> std::noskipws;
+    reused.encode(hfm::tree::any_block(), std::istream_iterator<char>(in), std::istream_iterator<char>(), buff);
+    test::check_equal(buff.size() <= reused.encoded_size_bound(100000), true);
+}
+
+void faulty_multi_stream_test(bool archive) {
+    std::string s = gen_string(100000);
+    std::string code = stream_load(std::vector<char>(s.begin(), s.end()));
+    size_t tree_size = HEADER_SIZE + (read_binary_<uint32_t>(code.begin() + HASH_SIZE_BYTES) & ~CANONICAL_FLAG);
+    ++code[tree_size + rnd.rand() * 10 % (code.size() - tree_size - INDEX_TRAILER_SIZE)];
+    if (!archive) {
+        partial_decode(code); // must throw
+    } else {
+        std::stringstream in(code), out;
+        hfm::archive arch(in);
+        arch.decode(out); // must throw
+    }
+}
+
+// a block count grown past what the index entry holds must be caught
+// before the symbols are written out
+template <typename Policy>
+void corrupted_count_test(Policy policy) {
+    std::string s = gen_string(100000);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode();
+    size_t block = code.size();
+    code += ht.encode(policy, s.begin(), s.end());
+    code += ht.encode_index();
+    auto cnt = read_binary_<uint32_t>(code.begin() + block + HASH_SIZE_BYTES);
+    write_binary_(cnt + 1000000, code.begin() + block + HASH_SIZE_BYTES);
+    std::stringstream in(code), out;
+    hfm::archive arch(in);
+    arch.decode(out); // must throw
+}
+
+// random bytes next to text the tree was built for: the random part
+// comes out as stored blocks
+std::string stored_load(std::string const& text, std::string const& binary) {
+    hfm::fcounter fc;
+    fc.update(text.begin(), text.end());
+    fc.update(binary.begin(), binary.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode() + ht.encode(hfm::tree::multi_stream(), text.begin(), text.end());
+    std::string stored = ht.encode(hfm::tree::multi_stream(), binary.begin(), binary.end());
+    test::check_equal(read_binary_<uint32_t>(stored.begin() + HASH_SIZE_BYTES),
+            (uint32_t) (binary.size() | BLOCK_STORED_FLAG));
+    test::check_equal(stored.size(), binary.size() + HEADER_SIZE);
+    code += stored + ht.encode(hfm::tree::single_block(), binary.begin(), binary.begin() + 3000);
+    code += ht.encode(hfm::tree::stored_block(), text.begin(), text.begin() + 5000);
+    return code + ht.encode_index();
+}
+
+void stored_block_test() {
+    std::string text = gen_string(50000), binary(20000, '\0');
+    for (auto& c : binary) {
+        c = (char) rnd.rand();
+    }
+    std::string code = stored_load(text, binary);
+    std::string expected = text + binary + binary.substr(0, 3000) + text.substr(0, 5000);
+    test::check_equal(partial_decode(code), expected);
+
+    std::stringstream in(code), out;
+    hfm::archive arch(in);
+    arch.decode(out);
+    test::check_equal(out.str(), expected);
+
+    hfm::tree d;
+    std::string bounded;
+    char buff[77];
+    for (size_t i = 0, produced = 0; i < code.size() || produced == sizeof(buff);) {
+        auto r = d.decode(code.data() + i, code.data() + std::min(code.size(), i + 1000), buff, sizeof(buff));
+        i += r.consumed;
+        produced = r.produced;
+        bounded.append(buff, produced);
+    }
+    test::check_equal(bounded, expected);
+}
+
+void faulty_stored_block_test() {
+    std::string binary(5000, '\0');
+    for (auto& c : binary) {
+        c = (char) rnd.rand();
+    }
+    std::string code = stored_load(gen_string(5000), binary);
+    ++code[code.size() - rnd.rand() % 15000 - 100];
+    partial_decode(code); // must throw
+}
+
+// every part gets its own tree, switched to with a table block
+std::string table_switch_load(std::vector<std::string> const& parts, bool canonical) {
+    std::string code;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        hfm::fcounter fc;
+        fc.update(parts[i].begin(), parts[i].end());
+        std::unique_ptr<hfm::tree> ht(canonical
+                ? new hfm::tree(fc, hfm::tree::canonical_header())
+                : new hfm::tree(fc));
+        code += i ? ht->encode_table() : ht->encode();
+        code += ht->encode(hfm::tree::multi_stream(), parts[i].begin(), parts[i].end());
+    }
+    return code;
+}
+
+void table_switch_test() {
+    for (bool canonical : {false, true}) {
+        std::vector<std::string> parts {gen_string(5000), "", std::string(3000, 'x'), gen_string(20000)};
+        std::string code = table_switch_load(parts, canonical);
+        test::check_equal(partial_decode(code), parts[0] + parts[1] + parts[2] + parts[3]);
+    }
+}
+
+void adaptive_encoder_test() {
+    std::string text = gen_string(20000), digits, binary;
+    for (size_t i = 0; i < 20000; ++i) {
+        digits += (char) ('0' + rnd.rand() % 4);
+        binary += (char) rnd.rand();
+    }
+    auto table_block = [](std::string const& code) {
+        return read_binary_<uint32_t>(code.begin() + HASH_SIZE_BYTES) & (BLOCK_TABLE_FLAG | BLOCK_COUNT_MASK);
+    };
+    for (bool canonical : {false, true}) {
+        hfm::adaptive_encoder enc(canonical);
+        std::string code = enc.encode(text.begin(), text.end());
+        std::string same = enc.encode(text.begin(), text.end());
+        std::string fresh = enc.encode(digits.begin(), digits.end());
+        std::string back = enc.encode(text.begin(), text.end());
+        std::string stored = enc.encode(binary.begin(), binary.end());
+        test::check_equal(table_block(same) & BLOCK_TABLE_FLAG, (uint32_t) 0);
+        test::check_equal(table_block(fresh), (uint32_t) (BLOCK_TABLE_FLAG | 1));
+        test::check_equal(table_block(back), (uint32_t) (BLOCK_TABLE_FLAG | TABLE_REF_FLAG));
+        test::check_equal(read_binary_<uint32_t>(stored.begin() + HASH_SIZE_BYTES),
+                (uint32_t) (binary.size() | BLOCK_STORED_FLAG));
+        code += same + fresh + back + stored;
+        test::check_equal(partial_decode(code), text + text + digits + text + binary);
+    }
+}
+
+// bytes allocated and not freed, 0 where malloc can't tell
+size_t heap_in_use() {
+#ifdef __GLIBC__
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+void adaptive_memory_test() {
+    // every chunk gets a table of its own: memory must not grow by a
+    // block per table kept
+    hfm::adaptive_encoder enc;
+    std::string chunk(1 << 20, 0), code;
+    size_t before = 0;
+    for (size_t k = 0; k < 64; ++k) {
+        for (char& c : chunk) {
+            c = (char) (k * 3 + rnd.rand() % (k % 5 + 2) * (rnd.rand() % 2 ? 1 : k + 1));
+        }
+        enc.encode(chunk.begin(), chunk.end(), code);
+        if (k == 8) {
+            before = heap_in_use();
+        }
+    }
+    test::check_equal(heap_in_use() < before + (8 << 20), true);
+}
+
+void unknown_table_test() {
+    std::string code = table_switch_load({gen_string(1000)}, false);
+    partial_decode(code + hfm::tree::encode_table_ref(1) + code.substr(code.size() - 100)); // must throw
+}
+
+void faulty_table_switch_test() {
+    std::string code = table_switch_load({gen_string(5000), gen_string(5000)}, rnd.rand() % 2);
+    ++code[rnd.rand() % code.size()];
+    partial_decode(code); // must throw
+}
+
+void thread_pool_test() {
+    for (size_t size : {1, 2, 5}) {
+        thread_pool pool(size);
+        test::check_equal(pool.size(), size);
+        for (size_t n : {0, 1, 3, 100}) {
+            std::vector<size_t> v(n);
+            pool.run(n, [&](size_t i) {
+                v[i] = i + 1;
+            });
+            for (size_t i = 0; i < n; ++i) {
+                test::check_equal(v[i], i + 1);
+            }
+        }
+        std::atomic<size_t> sum {0};
+        pool.run(10, [&](size_t i) {
+            pool.run(10, [&](size_t j) {
+                sum += i * 10 + j;
+            });
+        });
+        test::check_equal(sum.load(), (size_t) 4950);
+    }
+}
+
+void thread_pool_fault_test() {
+    thread_pool pool(4);
+    pool.run(100, [](size_t i) {
+        if (i == 42) {
+            throw std::runtime_error("task failed");
+        }
+    }); // must throw
+}
+
+void thread_pool_resize_test() {
+    std::string s = gen_string(3 * MTHREAD_LAUNCH_MINIMAL);
+    for (size_t size : {1, 3, 8}) {
+        thread_pool::resize(size);
+        test::check_equal(thread_pool::instance().size(), size);
+        hfm::fcounter fc;
+        fc.update(s.begin(), s.end());
+        hfm::tree ht(fc);
+        std::string code = ht.encode();
+        code += ht.encode(s.begin(), s.end());
+        code += ht.encode_index();
+        std::stringstream in(code), out;
+        hfm::archive arch(in);
+        arch.decode(out);
+        test::check_equal(out.str(), s);
+    }
+    thread_pool::resize(std::thread::hardware_concurrency());
+}
+
+void parallel_count_test() {
+    std::string s = gen_string(5 * MTHREAD_LAUNCH_MINIMAL + 17);
+    std::vector<size_t> expected(256);
+    for (char c : s) {
+        ++expected[(uint8_t) c];
+    }
+    for (size_t size : {2, 7, 64}) {
+        thread_pool::resize(size);
+        std::vector<size_t> counts(256);
+        parallel_count(s.begin(), s.end(), counts);
+        test::check_equal(true, counts == expected);
+    }
+    thread_pool::resize(std::thread::hardware_concurrency());
+}
+
+void histogram_test() {
+    std::string s = gen_string(100000);
+    for (size_t i = 0; i < 100; ++i) {
+        size_t from = rnd.rand() % 100, to = s.size() - rnd.rand() % 100;
+        std::vector<size_t> counts(256, 1), expected(256, 1);
+        for (size_t j = from; j < to; ++j) {
+            ++expected[(uint8_t) s[j]];
+        }
+        auto data = reinterpret_cast<uint8_t const*>(s.data());
+        histogram(data + from, data + to, counts.data());
+        test::check_equal(true, counts == expected);
+    }
+
+    std::string same(3 * HISTOGRAM_FLUSH + 5, '\xFF');
+    std::vector<size_t> counts(256);
+    auto data = reinterpret_cast<uint8_t const*>(same.data());
+    histogram(data, data + same.size(), counts.data());
+    test::check_equal(counts[255], same.size());
+}
+
+void crc32_test() {
+    test::check_equal(crc32("123456789", 9), (uint32_t) 0xCBF43926);
+    test::check_equal(crc32("", 0), (uint32_t) 0);
+
+    std::string s = gen_string(5000);
+    for (size_t i = 0; i < 200; ++i) {
+        size_t from = rnd.rand() % 100, len = rnd.rand() % (s.size() - from);
+        uint32_t expected = CRCMASK;
+        for (size_t j = from; j < from + len; ++j) {
+            expected = crc32_hash(expected, s[j]);
+        }
+        expected ^= CRCMASK;
+        test::check_equal(crc32(s.data() + from, len), expected);
+        test::check_equal(crc32(s.begin() + from, s.begin() + from + len), expected);
+
+        size_t mid = len ? rnd.rand() % len : 0;
+        test::check_equal(crc32(s.data() + from + mid, len - mid, crc32(s.data() + from, mid)), expected);
+        test::check_equal(crc32_combine(crc32(s.data() + from, mid), crc32(s.data() + from + mid, len - mid), len - mid),
+                expected);
+    }
+}
+
+void split_blocks_decode_test() {
+    std::string s = gen_string(20000);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode();
+    for (size_t i = 0, len; i < s.size(); i += len) {
+        len = std::min(s.size() - i, (size_t) rnd.rand() % 100 + 1);
+        code += ht.encode(hfm::tree::single_block(), s.begin() + i, s.begin() + i + len);
+    }
+    for (size_t piece : {1, 7, 16, 17, 100, 1000}) {
+        hfm::tree d;
+        std::string out;
+        for (size_t i = 0; i < code.size(); i += piece) {
+            size_t len = std::min(piece, code.size() - i);
+            if (piece % 2) {
+                d.prepare(code.data() + i, code.data() + i + len);
+            } else {
+                d.prepare(code.begin() + i, code.begin() + i + len);
+            }
+            std::string part(d.chars_left(), 0);
+            d.decode(part.begin(), part.end());
+            out += part;
+            d.clear();
+        }
+        test::check_equal(d.read_finished_success(), true);
+        test::check_equal(out, s);
+    }
+}
+
+void bounded_decode_test() {
+    std::string s = gen_string(100000);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode() + ht.encode(s.begin(), s.begin() + 30000)
+            + ht.encode(hfm::tree::multi_stream(), s.begin() + 30000, s.end());
+    code += ht.encode_index();
+
+    for (size_t avail : {1, 3, 64, 100000}) {
+        hfm::tree d;
+        std::string out;
+        std::vector<char> buff(avail);
+        for (size_t i = 0; i < code.size();) {
+            size_t len = std::min<size_t>(code.size() - i, rnd.rand() % 300 + 1);
+            auto r = d.decode(code.data() + i, code.data() + i + len, buff.data(), avail);
+            test::check_equal(r.produced <= avail, true);
+            test::check_equal(r.consumed < len && r.produced < avail, false);
+            out.append(buff.data(), r.produced);
+            i += r.consumed;
+        }
+        for (size_t produced = avail; produced == avail;) {
+            produced = d.decode(code.end(), code.end(), buff.data(), avail).produced;
+            out.append(buff.data(), produced);
+        }
+        test::check_equal(d.read_finished_success(), true);
+        test::check_equal(out, s);
+    }
+}
+
+void stream_round_trip_test() {
+    for (size_t buffer : {1, 7, 1000, 100000}) {
+        std::string s = gen_string(rnd.rand() % 50000);
+        hfm::fcounter fc;
+        fc.update(s.begin(), s.end());
+        hfm::tree ht(fc);
+        hfm::encoder_stream enc(ht, buffer);
+        hfm::decoder_stream dec(buffer);
+
+        std::string code, out;
+        char chunk[300];
+        auto pull = [&](auto& stream, std::string& dst) {
+            for (size_t n; (n = stream.read(chunk, rnd.rand() % sizeof(chunk) + 1));) {
+                dst.append(chunk, n);
+            }
+        };
+        for (size_t i = 0; i < s.size();) {
+            i += enc.write(s.data() + i, std::min<size_t>(s.size() - i, rnd.rand() % 300));
+            pull(enc, code);
+        }
+        enc.finish();
+        pull(enc, code);
+        test::check_equal(enc.done(), true);
+
+        for (size_t i = 0; i < code.size();) {
+            i += dec.write(code.data() + i, std::min<size_t>(code.size() - i, rnd.rand() % 300 + 1));
+            pull(dec, out);
+        }
+        pull(dec, out);
+        test::check_equal(dec.done(), true);
+        test::check_equal(out, s);
+
+        std::stringstream in(code), arch_out;
+        hfm::archive arch(in);
+        arch.decode(arch_out);
+        test::check_equal(arch_out.str(), s);
+    }
+}
+
+void unindexed_stream_test() {
+    std::string s = gen_string(100000);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    hfm::encoder_stream enc(ht, 64, false);
+    std::string code;
+    char chunk[300];
+    for (size_t i = 0; i < s.size();) {
+        i += enc.write(s.data() + i, s.size() - i);
+        for (size_t n; (n = enc.read(chunk, sizeof(chunk)));) {
+            code.append(chunk, n);
+        }
+    }
+    enc.finish();
+    for (size_t n; (n = enc.read(chunk, sizeof(chunk)));) {
+        code.append(chunk, n);
+    }
+    // thousands of blocks, none of them kept in the index
+    test::check_equal(ht.encode_index().size(), (size_t) HEADER_SIZE + INDEX_TRAILER_SIZE);
+    test::check_equal(partial_decode(code), s);
+}
+
+void mapped_archive_test() {
+    std::string s = gen_string(rnd.rand() % 3000000 + 1);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode();
+    for (size_t i = 0; i < s.size(); i += 100000) {
+        code += ht.encode(hfm::tree::multi_stream(), s.begin() + i, s.begin() + std::min(s.size(), i + 100000));
+    }
+    code += ht.encode_index();
+
+    char const* path = "mapped_archive_test.hfm";
+    {
+        hfm::mapped_output out(path, code.size() + 100);
+        test::check_equal(out.capacity(), code.size() + 100);
+        std::memcpy(out.data(), code.data(), code.size());
+        out.finish(code.size());
+    }
+    {
+        hfm::mapped_input in(path);
+        test::check_equal(in.size(), code.size());
+        test::check_equal(std::string(in.data(), in.data() + in.size()), code);
+
+        hfm::archive arch(in.data(), in.size());
+        test::check_equal(arch.indexed(), true);
+        std::string out(arch.size(), 0);
+        arch.decode(reinterpret_cast<uint8_t*>(out.data()));
+        test::check_equal(out, s);
+
+        std::stringstream part;
+        arch.decode_range(s.size() / 3, s.size() / 2, part);
+        test::check_equal(part.str(), s.substr(s.size() / 3, s.size() / 2));
+    }
+    {
+        // abandoned without finish(), as when encoding throws
+        hfm::mapped_output out(path, code.size());
+        std::memcpy(out.data(), code.data(), code.size());
+    }
+    test::check_equal(hfm::mapped_input(path).size(), (size_t) 0);
+    std::remove(path);
+}
+
+void uring_file_test(bool direct) {
+    std::string s = gen_string(rnd.rand() % 300000 + 1);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    hfm::tree ht(fc);
+    std::string code = ht.encode();
+    for (size_t i = 0; i < s.size(); i += 10000) {
+        code += ht.encode(hfm::tree::multi_stream(), s.begin() + i, s.begin() + std::min(s.size(), i + 10000));
+    }
+    code += ht.encode_index();
+
+    char const* path = "uring_file_test.hfm";
+    try {
+        // small buffers, so that the requests wrap around the ring
+        hfm::uring_writer wb(path, direct, 4096, 3);
+        std::ostream out(&wb);
+        for (size_t i = 0; i < code.size();) {
+            size_t n = std::min<size_t>(code.size() - i, rnd.rand() % 10000);
+            out.write(code.data() + i, n);
+            i += n;
+            if (rnd.rand() % 10 == 0) {
+                test::check_equal((bool) out.flush(), true);
+            }
+        }
+        test::check_equal((bool) out.flush(), true);
+    } catch (std::system_error const&) {
+        // no io_uring here, the callers fall back to streams
+        return;
+    }
+    {
+        hfm::uring_reader rb(path, direct, 4096, 3);
+        std::istream in(&rb);
+        std::string read((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        test::check_equal(read, code);
+
+        in.clear();
+        hfm::archive arch(in);
+        std::stringstream all, part;
+        arch.decode(all);
+        test::check_equal(all.str(), s);
+        arch.decode_range(s.size() / 3, s.size() / 2, part);
+        test::check_equal(part.str(), s.substr(s.size() / 3, s.size() / 2));
+    }
+    std::remove(path);
+}
+
+void pipeline_test() {
+    for (size_t depth : {1, 2, 5}) {
+        std::string s = gen_string(rnd.rand() % 100000), out;
+        size_t pos = 0;
+        hfm::run_pipeline<std::string, std::string>(depth,
+            [&](std::string& in) {
+                size_t n = std::min<size_t>(s.size() - pos, rnd.rand() % 1000 + 1);
+                in.assign(s, pos, n);
+                pos += n;
+                return n > 0;
+            },
+            [&](std::string& in, std::string& o) {
+                o = in;
+            },
+            [&](std::string& o) {
+                out += o;
+            });
+        test::check_equal(out, s);
+    }
+}
+
+void pipeline_fault_test() {
+    size_t reads = 0;
+    hfm::run_pipeline<int, int>(2,
+        [&](int& in) {
+            in = reads++;
+            return true;
+        },
+        [&](int& in, int& o) {
+            o = in;
+        },
+        [&](int& o) {
+            if (o == 100) {
+                throw std::runtime_error("write failed");
+            }
+        });
+}
+
+void parallel_multi_stream_test() {
+    std::string s = gen_string(2 * MTHREAD_LAUNCH_MINIMAL + 7);
+    hfm::fcounter fc;
+    fc.update(s.begin(), s.end());
+    for (size_t size : {3, 5}) {
+        thread_pool::resize(size);
+        hfm::tree ht(fc);
+        std::string code = ht.encode() + ht.encode(hfm::tree::multi_stream(), s.begin(), s.end());
+        size_t block = HEADER_SIZE + (read_binary_<uint32_t>(code.begin() + HASH_SIZE_BYTES) & ~CANONICAL_FLAG);
+        test::check_equal(read_binary_<uint32_t>(code.begin() + block + HASH_SIZE_BYTES),
+                (uint32_t) (s.size() | BLOCK_STREAMS_FLAG));
+        test::check_equal(read_binary_<uint32_t>(code.begin() + block + HEADER_SIZE), (uint32_t) (STREAM_CNT * size));
+        test::check_equal(partial_decode(code), s);
+
+        code += ht.encode_index();
+        std::stringstream in(code), out;
+        hfm::archive arch(in);
+        arch.decode(out);
+        test::check_equal(out.str(), s);
+    }
+    thread_pool::resize(std::thread::hardware_concurrency());
+}
+
 struct Deleter {
     void operator()(char *p) {
         operator delete(p);
@@ -644,6 +1552,10 @@ int main(int argc, char *argv[]) {
     test::run_test("complex bitset test", complex_bitset_test);
     test::run_test("bitset push test", bitset_push_test);
     test::run_test("bitset push-pop test", bitset_push_pop_test);
+    test::run_test("bit writer test", bit_writer_test);
+    test::run_test("thread pool test", thread_pool_test);
+    test::run_fault_test("thread pool fault test", thread_pool_fault_test);
+    test::run_test("code table test", code_table_test);
 
     test::run_test("simple fcounter test", simple_fcounter_test);
     test::run_test("complex fcounter test", complex_fcounter_test);
@@ -659,9 +1571,56 @@ int main(int argc, char *argv[]) {
     test::run_test("simple tree empty restore test", simple_tree_empty_restore_test);
     test::run_test("simple tree one restore test", simple_tree_one_restore_test);
     test::run_test("complex tree restore test", complex_tree_restore_test);
+    test::run_fault_test("oversized tree restore test", oversized_tree_restore_test);
     test::run_test("partial load tree test", megahard_discrete_load_tree_test);
     test::run_test("partial decode tree test", megahard_discrete_decode_tree_test);
     test::run_test("partial full tree test", megahard_full_tree_test);
+    test::run_test("long code tree test", long_code_tree_test);
+    test::run_test("simple canonical tree test", simple_canonical_tree_test);
+    test::run_test("complex canonical tree test", complex_canonical_tree_test);
+    test::run_multitest_faulty("faulty canonical tree test", 100, faulty_canonical_tree_test);
+    test::run_test("simple limited tree test", simple_limited_tree_test);
+    test::run_test("canonical limited tree test", canonical_limited_tree_test);
+    test::run_test("optimal limited tree test", optimal_limited_tree_test);
+    test::run_fault_test("small limit tree test", small_limit_tree_test);
+    test::run_test("indexed decode test", indexed_decode_test);
+    test::run_test("archive decode test", archive_decode_test);
+    test::run_test("archive range test", archive_range_test);
+    test::run_test("large block test", large_block_test);
+    test::run_fault_test("archive bad range test", archive_bad_range_test);
+    test::run_test("archive no index test", archive_no_index_test);
+    test::run_multitest_faulty("faulty index test", 100, faulty_index_test);
+    test::run_test("multi-stream tree test", multi_stream_tree_test);
+    test::run_test("reusable encode test", reusable_encode_test);
+    test::run_test("thread pool resize test", thread_pool_resize_test);
+    test::run_test("parallel multi-stream test", parallel_multi_stream_test);
+    test::run_test("parallel count test", parallel_count_test);
+    test::run_test("histogram test", histogram_test);
+    test::run_test("crc32 test", crc32_test);
+    test::run_test("split blocks decode test", split_blocks_decode_test);
+    test::run_test("bounded decode test", bounded_decode_test);
+    test::run_test("stream round trip test", stream_round_trip_test);
+    test::run_test("unindexed stream test", unindexed_stream_test);
+    test::run_test("mapped archive test", mapped_archive_test);
+    test::run_test("pipeline test", pipeline_test);
+    test::run_test("io_uring file test", uring_file_test, false);
+    test::run_test("io_uring direct file test", uring_file_test, true);
+    test::run_fault_test("pipeline fault test", pipeline_fault_test);
+    test::run_test("table switch test", table_switch_test);
+    test::run_multitest_faulty("faulty table switch test", 100, faulty_table_switch_test);
+    test::run_test("adaptive encoder test", adaptive_encoder_test);
+    test::run_test("adaptive memory test", adaptive_memory_test);
+    test::run_test("stored block test", stored_block_test);
+    test::run_multitest_faulty("faulty stored block test", 100, faulty_stored_block_test);
+    test::run_fault_test("corrupted count test, single block", corrupted_count_test<hfm::tree::single_block>,
+            hfm::tree::single_block());
+    test::run_fault_test("corrupted count test, stored block", corrupted_count_test<hfm::tree::stored_block>,
+            hfm::tree::stored_block());
+    test::run_fault_test("corrupted count test, multi-stream", corrupted_count_test<hfm::tree::multi_stream>,
+            hfm::tree::multi_stream());
+    test::run_fault_test("unknown table test", unknown_table_test);
+    test::run_multitest_faulty("faulty multi-stream test, stream decode", 100, faulty_multi_stream_test, false);
+    test::run_multitest_faulty("faulty multi-stream test, archive decode", 100, faulty_multi_stream_test, true);
     test::run_multitest_faulty("faulty decode test, header corrupt", 100, faulty_encode_decode_test, true);
     test::run_multitest_faulty("faulty decode test, block corrupt", 100, faulty_encode_decode_test, false);
     test::run_multitest("e/d complex data", 100, complex_data_faulty_test, false);
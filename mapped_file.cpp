@@ -0,0 +1,126 @@
+//
+//  author dzhiblavi
+//
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.hpp"
+
+namespace hfm {
+static std::system_error mapping_error_(char const* what, int error = errno) {
+    return std::system_error(error, std::generic_category(), what);
+}
+
+mapped_input::mapped_input(char const* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw mapping_error_("failed to open input file");
+    }
+    struct stat st {};
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw mapping_error_("failed to stat input file");
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument), "input is not a regular file");
+    }
+    size_ = st.st_size;
+    // mmap refuses empty mappings, an empty file needs none
+    if (size_) {
+        data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data_ == MAP_FAILED) {
+            data_ = nullptr;
+            close(fd);
+            throw mapping_error_("failed to map input file");
+        }
+        madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+mapped_input::~mapped_input() {
+    if (data_) {
+        munmap(data_, size_);
+    }
+}
+
+uint8_t const* mapped_input::data() const {
+    return static_cast<uint8_t const*>(data_);
+}
+
+size_t mapped_input::size() const {
+    return size_;
+}
+
+mapped_output::mapped_output(char const* path, size_t capacity)
+: capacity_(capacity) {
+    fd_ = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        throw mapping_error_("failed to open output file");
+    }
+    if (!capacity_) {
+        return;
+    }
+    // a sparse file would raise SIGBUS on a full disk, reserving the
+    // blocks up front reports it here instead
+    int res = posix_fallocate(fd_, 0, capacity_);
+    if (res) {
+        discard_();
+        throw mapping_error_("failed to reserve output file", res);
+    }
+    data_ = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data_ == MAP_FAILED) {
+        int error = errno;
+        data_ = nullptr;
+        discard_();
+        throw mapping_error_("failed to map output file", error);
+    }
+}
+
+void mapped_output::unmap_() {
+    if (data_) {
+        munmap(data_, capacity_);
+        data_ = nullptr;
+    }
+}
+
+void mapped_output::discard_() {
+    unmap_();
+    if (fd_ >= 0) {
+        int res = ftruncate(fd_, 0);
+        (void) res;
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+// not finished: the encoding failed, don't leave the reserved space behind
+mapped_output::~mapped_output() {
+    discard_();
+}
+
+uint8_t* mapped_output::data() {
+    return static_cast<uint8_t*>(data_);
+}
+
+size_t mapped_output::capacity() const {
+    return capacity_;
+}
+
+void mapped_output::finish(size_t size) {
+    unmap_();
+    int res = ftruncate(fd_, size);
+    close(fd_);
+    fd_ = -1;
+    if (res < 0) {
+        throw mapping_error_("failed to size output file");
+    }
+}
+} // namespace hfm
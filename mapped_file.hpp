@@ -0,0 +1,54 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_MAPPED_FILE_H_
+#define HUFFMAN_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace hfm {
+// Whole-file mappings, so that the data is read from and written to the
+// page cache without a copy through stream buffers. Failing to set up a
+// mapping throws std::system_error, callers fall back to streams on it.
+
+// read-only mapping of a regular file, advised for sequential reading
+class mapped_input {
+    void* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    explicit mapped_input(char const* path);
+    mapped_input& operator=(mapped_input const&) = delete;
+    mapped_input(mapped_input const&) = delete;
+    ~mapped_input();
+
+    uint8_t const* data() const;
+    size_t size() const;
+};
+
+// output file created with capacity bytes reserved and mapped for
+// writing; finish() cuts it down to the bytes actually written, without
+// finish() it is left empty
+class mapped_output {
+    int fd_ = -1;
+    void* data_ = nullptr;
+    size_t capacity_ = 0;
+
+    void unmap_();
+    void discard_();
+
+public:
+    mapped_output(char const* path, size_t capacity);
+    mapped_output& operator=(mapped_output const&) = delete;
+    mapped_output(mapped_output const&) = delete;
+    ~mapped_output();
+
+    uint8_t* data();
+    size_t capacity() const;
+    void finish(size_t size);
+};
+} // namespace hfm
+
+#endif // HUFFMAN_MAPPED_FILE_H_
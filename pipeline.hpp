@@ -0,0 +1,148 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_PIPELINE_H_
+#define HUFFMAN_PIPELINE_H_
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hfm {
+// Bounded FIFO handing buffers from one pipeline stage to the next.
+// close() lets the consumer drain what is left, cancel() drops it.
+template <typename T>
+class bounded_queue {
+    std::vector<T> items_;
+    size_t first_ = 0;
+    size_t size_ = 0;
+    bool closed_ = false;
+    bool cancelled_ = false;
+    std::mutex m_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+
+public:
+    explicit bounded_queue(size_t capacity)
+    : items_(capacity) {}
+
+    // waits while the queue is full, false if it was cancelled
+    bool push(T value) {
+        std::unique_lock<std::mutex> lg(m_);
+        not_full_.wait(lg, [this] { return cancelled_ || size_ < items_.size(); });
+        if (cancelled_) {
+            return false;
+        }
+        items_[(first_ + size_++) % items_.size()] = std::move(value);
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // waits while the queue is empty, false once it is closed and
+    // drained or cancelled
+    bool pop(T& value) {
+        std::unique_lock<std::mutex> lg(m_);
+        not_empty_.wait(lg, [this] { return cancelled_ || closed_ || size_; });
+        if (cancelled_ || !size_) {
+            return false;
+        }
+        value = std::move(items_[first_]);
+        first_ = (first_ + 1) % items_.size();
+        --size_;
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lg(m_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lg(m_);
+        cancelled_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+};
+
+// Runs read on a reader thread, process on the calling thread and write
+// on a writer thread, so that input, computation and output overlap:
+//   bool read(In&)           fills the next input, false at the end
+//   void process(In&, Out&)
+//   void write(Out&)
+// depth buffers of each type are allocated once and passed around, so
+// they keep their storage. Inputs are processed and written in order.
+// The first exception thrown by a stage stops the others and is rethrown.
+template <typename In, typename Out, typename Read, typename Process, typename Write>
+void run_pipeline(size_t depth, Read read, Process process, Write write) {
+    std::vector<In> in(depth);
+    std::vector<Out> out(depth);
+    bounded_queue<In*> free_in(depth), full_in(depth);
+    bounded_queue<Out*> free_out(depth), full_out(depth);
+    for (size_t i = 0; i < depth; ++i) {
+        free_in.push(&in[i]);
+        free_out.push(&out[i]);
+    }
+
+    std::exception_ptr error;
+    std::mutex error_m;
+    auto fail = [&] {
+        {
+            std::lock_guard<std::mutex> lg(error_m);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        free_in.cancel();
+        full_in.cancel();
+        free_out.cancel();
+        full_out.cancel();
+    };
+
+    std::thread reader([&] {
+        try {
+            In* b;
+            while (free_in.pop(b) && read(*b) && full_in.push(b)) {}
+            full_in.close();
+        } catch (...) {
+            fail();
+        }
+    });
+    std::thread writer([&] {
+        try {
+            Out* b;
+            while (full_out.pop(b)) {
+                write(*b);
+                free_out.push(b);
+            }
+        } catch (...) {
+            fail();
+        }
+    });
+
+    try {
+        In* b;
+        Out* o;
+        while (full_in.pop(b) && free_out.pop(o)) {
+            process(*b, *o);
+            free_in.push(b);
+            full_out.push(o);
+        }
+        full_out.close();
+    } catch (...) {
+        fail();
+    }
+    reader.join();
+    writer.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+} // namespace hfm
+
+#endif // HUFFMAN_PIPELINE_H_
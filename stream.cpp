@@ -0,0 +1,117 @@
+//
+//  author dzhiblavi
+//
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "stream.hpp"
+
+namespace hfm {
+encoder_stream::encoder_stream(tree& t, size_t buffer_size, bool index)
+: tree_(t)
+, in_(buffer_size)
+, out_(t.encode())
+, index_(index) {
+    if (!buffer_size) {
+        throw std::invalid_argument("stream buffer size must be positive");
+    }
+}
+
+// the next block is encoded only once the previous one has been read
+void encoder_stream::pump_() {
+    if (out_pos_ < out_.size() || finished_) {
+        return;
+    }
+    out_pos_ = 0;
+    if (in_size_ == in_.size() || (finishing_ && in_size_)) {
+        tree_.encode(tree::single_block(), in_.data(), in_.data() + in_size_, out_);
+        in_size_ = 0;
+        if (!index_) {
+            tree_.drop_index();
+        }
+    } else if (finishing_) {
+        out_.clear();
+        if (index_) {
+            out_ = tree_.encode_index();
+        }
+        finished_ = true;
+    } else {
+        out_.clear();
+    }
+}
+
+size_t encoder_stream::write(void const* data, size_t len) {
+    if (finishing_) {
+        throw std::logic_error("write after finish");
+    }
+    auto p = static_cast<char const*>(data);
+    size_t taken = 0;
+    while (taken < len && in_size_ < in_.size()) {
+        size_t n = std::min(len - taken, in_.size() - in_size_);
+        std::memcpy(in_.data() + in_size_, p + taken, n);
+        in_size_ += n;
+        taken += n;
+        pump_();
+    }
+    return taken;
+}
+
+void encoder_stream::finish() {
+    finishing_ = true;
+    pump_();
+}
+
+size_t encoder_stream::read(void* out, size_t avail) {
+    auto p = static_cast<char*>(out);
+    size_t given = 0;
+    while (given < avail) {
+        pump_();
+        if (out_pos_ == out_.size()) {
+            break;
+        }
+        size_t n = std::min(avail - given, out_.size() - out_pos_);
+        std::memcpy(p + given, out_.data() + out_pos_, n);
+        out_pos_ += n;
+        given += n;
+    }
+    return given;
+}
+
+bool encoder_stream::done() const {
+    return finished_ && out_pos_ == out_.size();
+}
+
+decoder_stream::decoder_stream(size_t buffer_size)
+: in_(buffer_size) {
+    if (!buffer_size) {
+        throw std::invalid_argument("stream buffer size must be positive");
+    }
+}
+
+size_t decoder_stream::write(void const* data, size_t len) {
+    if (in_first_ && in_last_ == in_.size()) {
+        std::memmove(in_.data(), in_.data() + in_first_, in_last_ - in_first_);
+        in_last_ -= in_first_;
+        in_first_ = 0;
+    }
+    size_t n = std::min(len, in_.size() - in_last_);
+    std::memcpy(in_.data() + in_last_, data, n);
+    in_last_ += n;
+    return n;
+}
+
+size_t decoder_stream::read(void* out, size_t avail) {
+    auto r = tree_.decode(in_.data() + in_first_, in_.data() + in_last_, out, avail);
+    in_first_ += r.consumed;
+    if (in_first_ == in_last_) {
+        in_first_ = in_last_ = 0;
+    }
+    return r.produced;
+}
+
+bool decoder_stream::done() const {
+    return in_first_ == in_last_ && tree_.read_finished_success();
+}
+} // namespace hfm
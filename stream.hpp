@@ -0,0 +1,71 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_STREAM_H_
+#define HUFFMAN_STREAM_H_
+
+#include <string>
+#include <vector>
+
+#include "encoder.hpp"
+
+namespace hfm {
+// Push/pull encoder over a fixed input buffer: write() takes input in
+// pieces of any size, read() hands out the encoded stream (tree header,
+// one block per buffer_size input bytes, then the index). Memory stays at
+// one input buffer and one encoded block, both reused, plus an index
+// entry of INDEX_ENTRY_SIZE bytes per block when the index is written:
+// streams of unbounded length should be opened with index = false.
+class encoder_stream {
+    tree& tree_;
+    std::vector<char> in_;
+    size_t in_size_ = 0;
+    std::string out_;
+    size_t out_pos_ = 0;
+    bool index_;
+    bool finishing_ = false;
+    bool finished_ = false;
+
+    void pump_();
+
+public:
+    // t must outlive the stream and must not have encoded anything yet,
+    // since the index refers to the blocks encoded by t
+    explicit encoder_stream(tree& t, size_t buffer_size = STREAM_BUFFER_SIZE, bool index = true);
+    encoder_stream& operator=(encoder_stream const&) = delete;
+    encoder_stream(encoder_stream const&) = delete;
+
+    // takes as much of [data, data + len) as fits and returns how much
+    // that was; 0 means the encoded output has to be read first
+    size_t write(void const* data, size_t len);
+    // no more input: the rest is encoded on the following reads
+    void finish();
+    size_t read(void* out, size_t avail);
+    // finish() was called and all the output has been read
+    bool done() const;
+};
+
+// Push/pull decoder over a fixed input buffer, the symbols are decoded
+// straight into the buffers passed to read().
+class decoder_stream {
+    tree tree_;
+    std::vector<char> in_;
+    size_t in_first_ = 0;
+    size_t in_last_ = 0;
+
+public:
+    explicit decoder_stream(size_t buffer_size = STREAM_BUFFER_SIZE);
+    decoder_stream& operator=(decoder_stream const&) = delete;
+    decoder_stream(decoder_stream const&) = delete;
+
+    // takes as much of [data, data + len) as fits and returns how much
+    // that was; 0 means the buffered input has to be read out first
+    size_t write(void const* data, size_t len);
+    size_t read(void* out, size_t avail);
+    // the input seen so far is a complete stream and nothing is pending
+    bool done() const;
+};
+} // namespace hfm
+
+#endif // HUFFMAN_STREAM_H_
@@ -0,0 +1,133 @@
+//
+//  author dzhiblavi
+//
+
+#include <algorithm>
+
+#include "threadpool.hpp"
+
+static std::unique_ptr<thread_pool>& instance_() {
+    static std::unique_ptr<thread_pool> pool(new thread_pool(std::max(1u, std::thread::hardware_concurrency())));
+    return pool;
+}
+
+thread_pool::thread_pool(size_t size) {
+    for (size_t i = 1; i < size; ++i) {
+        workers_.emplace_back([this] { work_(); });
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> lg(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) {
+        t.join();
+    }
+}
+
+size_t thread_pool::size() const {
+    return workers_.size() + 1;
+}
+
+void thread_pool::drain_(batch& b) {
+    for (size_t i; (i = b.next++) < b.n;) {
+        std::exception_ptr error;
+        try {
+            b.call(b.f, i);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lg(b.m);
+        if (error && !b.error) {
+            b.error = error;
+        }
+        if (++b.done == b.n) {
+            b.cv.notify_all();
+        }
+    }
+}
+
+void thread_pool::work_() {
+    for (;;) {
+        batch* b;
+        {
+            std::unique_lock<std::mutex> lg(m_);
+            cv_.wait(lg, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            b = queue_.front();
+            if (!--b->wanted) {
+                queue_.erase(queue_.begin());
+            }
+            ++b->active;
+        }
+        drain_(*b);
+        std::lock_guard<std::mutex> lg(m_);
+        --b->active;
+        released_.notify_all();
+    }
+}
+
+void thread_pool::run_(size_t n, void (*call)(void const*, size_t), void const* f) {
+    if (!n) {
+        return;
+    }
+    size_t helpers = std::min(n - 1, workers_.size());
+    batch* b;
+    {
+        std::lock_guard<std::mutex> lg(m_);
+        if (free_.empty()) {
+            batches_.emplace_back(new batch);
+            free_.reserve(batches_.size());
+            b = batches_.back().get();
+        } else {
+            b = free_.back();
+            free_.pop_back();
+        }
+        b->call = call;
+        b->f = f;
+        b->n = n;
+        b->next = 0;
+        b->done = 0;
+        b->wanted = helpers;
+        if (helpers) {
+            queue_.push_back(b);
+        }
+    }
+    for (size_t i = 0; i < helpers; ++i) {
+        cv_.notify_one();
+    }
+    drain_(*b);
+    {
+        std::unique_lock<std::mutex> lg(b->m);
+        b->cv.wait(lg, [b] { return b->done == b->n; });
+    }
+
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lg(m_);
+        // the tasks are done, helpers that have not come yet are not needed
+        if (b->wanted) {
+            queue_.erase(std::find(queue_.begin(), queue_.end(), b));
+            b->wanted = 0;
+        }
+        released_.wait(lg, [b] { return !b->active; });
+        std::swap(error, b->error);
+        free_.push_back(b);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+thread_pool& thread_pool::instance() {
+    return *instance_();
+}
+
+void thread_pool::resize(size_t size) {
+    instance_().reset(new thread_pool(std::max<size_t>(1, size)));
+}
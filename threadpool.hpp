@@ -0,0 +1,71 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_THREADPOOL_H_
+#define HUFFMAN_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Long-lived workers for the parallel count, encode and decode paths.
+// A pool of size n keeps n - 1 threads, the thread calling run() is the
+// n-th one, so run() may also be called from inside a task.
+class thread_pool {
+    struct batch {
+        void (*call)(void const*, size_t);
+        void const* f;
+        size_t n;
+        std::atomic<size_t> next {0};
+        size_t done = 0;
+        std::exception_ptr error;
+        std::mutex m;
+        std::condition_variable cv;
+        // helpers yet to take the batch and helpers working on it,
+        // guarded by the pool mutex
+        size_t wanted = 0;
+        size_t active = 0;
+    };
+
+    std::vector<std::thread> workers_;
+    // batches are kept for reuse: run() allocates only until there are as
+    // many as calls running at once
+    std::vector<std::unique_ptr<batch>> batches_;
+    std::vector<batch*> free_;
+    std::vector<batch*> queue_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::condition_variable released_;
+    bool stop_ = false;
+
+    void work_();
+    static void drain_(batch& b);
+    void run_(size_t n, void (*call)(void const*, size_t), void const* f);
+
+public:
+    explicit thread_pool(size_t size);
+    thread_pool& operator=(thread_pool const&) = delete;
+    thread_pool(thread_pool const&) = delete;
+    ~thread_pool();
+
+    size_t size() const;
+
+    // calls f(0), ..., f(n - 1) on the pool and waits for all of them,
+    // the first exception thrown by a task is rethrown here
+    template <typename F>
+    void run(size_t n, F const& f) {
+        run_(n, [](void const* f, size_t i) { (*static_cast<F const*>(f))(i); }, &f);
+    }
+
+    // the library-wide pool, hardware_concurrency() threads unless
+    // resized; resize() must not race with running tasks
+    static thread_pool& instance();
+    static void resize(size_t size);
+};
+
+#endif // HUFFMAN_THREADPOOL_H_
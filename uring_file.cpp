@@ -0,0 +1,389 @@
+//
+//  author dzhiblavi
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HFM_HAS_URING 1
+#endif
+
+#include "uring_file.hpp"
+
+namespace hfm {
+static std::system_error uring_error_(char const* what, int error = errno) {
+    return std::system_error(error, std::generic_category(), what);
+}
+
+#ifdef HFM_HAS_URING
+// submission and completion queues shared with the kernel
+struct uring_file::ring {
+    int fd = -1;
+    void* sq_ptr = MAP_FAILED;
+    void* cq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    explicit ring(unsigned entries) {
+        io_uring_params p {};
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0) {
+            throw uring_error_("io_uring is not available");
+        }
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            release_();
+            throw uring_error_("failed to map io_uring");
+        }
+        cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP)
+                ? sq_ptr
+                : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+            release_();
+            throw uring_error_("failed to map io_uring");
+        }
+        auto sq = static_cast<char*>(sq_ptr);
+        auto cq = static_cast<char*>(cq_ptr);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    ~ring() {
+        release_();
+    }
+
+    void release_() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != MAP_FAILED) {
+            munmap(sq_ptr, sq_size);
+        }
+        close(fd);
+    }
+
+    int enter_(unsigned submit, unsigned wait) {
+        int res;
+        do {
+            res = syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (res < 0 && errno == EINTR);
+        return res;
+    }
+
+    // the caller never has more requests in flight than the ring has
+    // entries, so there is always a free one
+    void push(bool write, int file, void* data, unsigned len, uint64_t offset, uint64_t tag) {
+        unsigned tail = *sq_tail;
+        unsigned i = tail & *sq_mask;
+        io_uring_sqe& sqe = sqes[i];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = len;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sq_array[i] = i;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        if (enter_(1, 0) < 0) {
+            throw uring_error_("failed to submit io_uring request");
+        }
+    }
+
+    // waits for the next completion: {tag, result}
+    std::pair<uint64_t, int> wait() {
+        unsigned head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            if (enter_(0, 1) < 0) {
+                throw uring_error_("failed to wait for io_uring completion");
+            }
+        }
+        io_uring_cqe& cqe = cqes[head & *cq_mask];
+        std::pair<uint64_t, int> ret(cqe.user_data, cqe.res);
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return ret;
+    }
+};
+#else
+struct uring_file::ring {
+    explicit ring(unsigned) {
+        throw std::system_error(std::make_error_code(std::errc::function_not_supported), "io_uring is not available");
+    }
+
+    void push(bool, int, void*, unsigned, uint64_t, uint64_t) {}
+
+    std::pair<uint64_t, int> wait() {
+        return {0, 0};
+    }
+};
+#endif
+
+uring_file::uring_file(char const* path, int flags, bool write, size_t buffer_size, size_t depth, bool direct)
+: ring_(new ring(depth))
+, write_(write)
+, buffer_size_((buffer_size + URING_ALIGNMENT - 1) / URING_ALIGNMENT * URING_ALIGNMENT)
+, buffers_(depth) {
+    for (auto& b : buffers_) {
+        b.data = static_cast<char*>(std::aligned_alloc(URING_ALIGNMENT, buffer_size_));
+        if (!b.data) {
+            release_();
+            throw std::bad_alloc();
+        }
+    }
+    if (direct) {
+        fd_ = open(path, flags | O_DIRECT, 0644);
+        direct_ = fd_ >= 0;
+    }
+    // some filesystems (tmpfs) refuse O_DIRECT
+    if (fd_ < 0) {
+        fd_ = open(path, flags, 0644);
+    }
+    if (fd_ < 0) {
+        int error = errno;
+        release_();
+        throw uring_error_(write ? "failed to open output file" : "failed to open input file", error);
+    }
+}
+
+uring_file::~uring_file() {
+    release_();
+}
+
+void uring_file::release_() {
+    for (auto& b : buffers_) {
+        std::free(b.data);
+        b.data = nullptr;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+void uring_file::submit_(size_t i, uint64_t offset, size_t size) {
+    buffer& b = buffers_[i];
+    b.offset = offset;
+    b.size = size;
+    b.done = 0;
+    b.busy = true;
+    ring_->push(write_, fd_, b.data, size, offset, i);
+}
+
+void uring_file::wait_(size_t i) {
+    while (buffers_[i].busy) {
+        auto [tag, res] = ring_->wait();
+        buffer& b = buffers_[tag];
+        if (res < 0) {
+            error_ = -res;
+            b.busy = false;
+            continue;
+        }
+        b.done += res;
+        if (!res || b.done == b.size || b.offset + b.done >= end_) {
+            // a read stops at the end of the file, a write must not stop
+            if (!res && write_) {
+                error_ = EIO;
+            }
+            b.size = b.done;
+            b.busy = false;
+        } else {
+            ring_->push(write_, fd_, b.data + b.done, b.size - b.done, b.offset + b.done, tag);
+        }
+    }
+}
+
+void uring_file::wait_all_() {
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+        wait_(i);
+    }
+}
+
+uring_reader::uring_reader(char const* path, bool direct, size_t buffer_size, size_t depth)
+: uring_file(path, O_RDONLY, false, buffer_size, depth, direct) {
+    struct stat st {};
+    if (fstat(fd_, &st) < 0) {
+        throw uring_error_("failed to stat input file");
+    }
+    if (!S_ISREG(st.st_mode)) {
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument), "input is not a regular file");
+    }
+    size_ = end_ = st.st_size;
+    start_(0);
+}
+
+uring_reader::~uring_reader() {
+    wait_all_();
+}
+
+// drops whatever is buffered and reads ahead from pos on; requests start
+// at an aligned offset, the bytes before pos are skipped
+void uring_reader::start_(uint64_t pos) {
+    wait_all_();
+    setg(nullptr, nullptr, nullptr);
+    current_ = false;
+    head_ = 0;
+    next_ = pos / URING_ALIGNMENT * URING_ALIGNMENT;
+    skip_ = pos - next_;
+    for (queued_ = 0; queued_ < buffers_.size() && next_ < size_; ++queued_) {
+        submit_(queued_, next_, buffer_size_);
+        next_ += buffer_size_;
+    }
+}
+
+uring_reader::int_type uring_reader::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (current_) {
+        // the consumed buffer goes on to read further ahead
+        if (next_ < size_) {
+            submit_(head_, next_, buffer_size_);
+            next_ += buffer_size_;
+        } else {
+            --queued_;
+        }
+        head_ = (head_ + 1) % buffers_.size();
+        current_ = false;
+    }
+    buffer& b = buffers_[head_];
+    if (!queued_) {
+        return traits_type::eof();
+    }
+    wait_(head_);
+    if (error_) {
+        throw uring_error_("failed to read input file", error_);
+    }
+    current_ = true;
+    size_t skip = std::min(skip_, b.size);
+    skip_ = 0;
+    setg(b.data, b.data + skip, b.data + b.size);
+    if (gptr() == egptr()) {
+        return underflow();
+    }
+    return traits_type::to_int_type(*gptr());
+}
+
+// the first byte not read yet
+uint64_t uring_reader::pos_() const {
+    buffer const& b = buffers_[head_];
+    if (current_) {
+        return b.offset + (gptr() - eback());
+    }
+    return queued_ ? b.offset + skip_ : size_;
+}
+
+uring_reader::pos_type uring_reader::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    uint64_t pos = pos_();
+    if (dir == std::ios_base::beg) {
+        pos = off;
+    } else if (dir == std::ios_base::cur) {
+        pos += off;
+    } else {
+        pos = size_ + off;
+    }
+    return seekpos(pos, which);
+}
+
+uring_reader::pos_type uring_reader::seekpos(pos_type pos, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in) || pos < 0 || (uint64_t) pos > size_) {
+        return pos_type(off_type(-1));
+    }
+    uint64_t p = pos;
+    buffer& b = buffers_[head_];
+    // nearby positions are served by the buffers already read
+    if (current_ && p >= b.offset && p <= b.offset + b.size) {
+        setg(b.data, b.data + (p - b.offset), b.data + b.size);
+        return pos;
+    }
+    if (!current_ && queued_ && p >= b.offset && p < b.offset + b.size) {
+        skip_ = p - b.offset;
+        return pos;
+    }
+    start_(p);
+    return pos;
+}
+
+uring_writer::uring_writer(char const* path, bool direct, size_t buffer_size, size_t depth)
+: uring_file(path, O_WRONLY | O_CREAT | O_TRUNC, true, buffer_size, depth, direct) {
+    setp(buffers_[0].data, buffers_[0].data + buffer_size_);
+}
+
+uring_writer::~uring_writer() {
+    sync();
+    wait_all_();
+}
+
+uring_writer::int_type uring_writer::overflow(int_type c) {
+    if (error_) {
+        return traits_type::eof();
+    }
+    if (pptr() == epptr()) {
+        submit_(current_, offset_, buffer_size_);
+        offset_ += buffer_size_;
+        current_ = (current_ + 1) % buffers_.size();
+        wait_(current_);
+        if (error_) {
+            return traits_type::eof();
+        }
+        setp(buffers_[current_].data, buffers_[current_].data + buffer_size_);
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+// the partial buffer stays current: later bytes are appended to it and
+// it is written again at the same offset
+int uring_writer::sync() {
+    size_t len = pptr() - pbase();
+    if (len && !error_) {
+        // O_DIRECT writes whole blocks, the padding is cut off below
+        size_t size = direct_ ? (len + URING_ALIGNMENT - 1) / URING_ALIGNMENT * URING_ALIGNMENT : len;
+        std::memset(pptr(), 0, size - len);
+        submit_(current_, offset_, size);
+    }
+    wait_all_();
+    if (!error_ && ftruncate(fd_, offset_ + len) < 0) {
+        error_ = errno;
+    }
+    return error_ ? -1 : 0;
+}
+} // namespace hfm
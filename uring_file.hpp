@@ -0,0 +1,101 @@
+//
+//  author dzhiblavi
+//
+
+#ifndef HUFFMAN_URING_FILE_H_
+#define HUFFMAN_URING_FILE_H_
+
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+#include <vector>
+
+#include "util.hpp"
+
+namespace hfm {
+// Stream buffers over io_uring (raw syscalls, no liburing), so that any
+// istream/ostream code, e.g. archive or the stream classes fed from a
+// file, keeps depth aligned requests in flight instead of one blocking
+// call at a time. With direct the file is opened with O_DIRECT where the
+// filesystem allows it. Failing to set up the ring or the file throws
+// std::system_error, callers fall back to std::filebuf on it; I/O errors
+// later on fail the stream like std::filebuf does.
+class uring_file {
+protected:
+    struct ring;
+    struct buffer {
+        char* data = nullptr;
+        uint64_t offset = 0;
+        size_t size = 0;
+        size_t done = 0;
+        bool busy = false;
+    };
+
+    std::unique_ptr<ring> ring_;
+    int fd_ = -1;
+    bool write_;
+    bool direct_ = false;
+    size_t buffer_size_;
+    std::vector<buffer> buffers_;
+    // reads stop short at the end of the file
+    uint64_t end_ = UINT64_MAX;
+    int error_ = 0;
+
+    void release_();
+
+    uring_file(char const* path, int flags, bool write, size_t buffer_size, size_t depth, bool direct);
+    ~uring_file();
+
+    // requests size bytes of buffers_[i] at offset
+    void submit_(size_t i, uint64_t offset, size_t size);
+    // waits until buffers_[i] has no request in flight
+    void wait_(size_t i);
+    void wait_all_();
+
+public:
+    uring_file& operator=(uring_file const&) = delete;
+    uring_file(uring_file const&) = delete;
+};
+
+// Sequential read-ahead over a regular file, seeking restarts it.
+class uring_reader : public uring_file, public std::streambuf {
+    uint64_t size_ = 0;
+    uint64_t next_ = 0;
+    size_t head_ = 0;
+    // buffers read or being read and not yet consumed, from head_ on
+    size_t queued_ = 0;
+    size_t skip_ = 0;
+    bool current_ = false;
+
+    void start_(uint64_t pos);
+    uint64_t pos_() const;
+
+protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+public:
+    explicit uring_reader(char const* path, bool direct = false,
+            size_t buffer_size = URING_BUFFER_SIZE, size_t depth = URING_DEPTH);
+    ~uring_reader() override;
+};
+
+// Write-behind into a new file: full buffers are written while the next
+// ones fill up. sync() writes the partial buffer and waits for everything.
+class uring_writer : public uring_file, public std::streambuf {
+    uint64_t offset_ = 0;
+    size_t current_ = 0;
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+public:
+    explicit uring_writer(char const* path, bool direct = false,
+            size_t buffer_size = URING_BUFFER_SIZE, size_t depth = URING_DEPTH);
+    ~uring_writer() override;
+};
+} // namespace hfm
+
+#endif // HUFFMAN_URING_FILE_H_
@@ -4,11 +4,242 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 
 #include "util.hpp"
 
+struct crc32_tables {
+    uint32_t t[16][256];
+};
+
+// t[0] is the plain byte table, t[k][c] is the register after c is
+// followed by k zero bytes, which lets the loop fold 16 bytes at once
+static constexpr crc32_tables make_crc32_tables() {
+    crc32_tables ret {};
+    for (uint32_t c = 0; c < 256; ++c) {
+        uint32_t r = c;
+        for (size_t i = 0; i < 8; ++i) {
+            r = r & 1 ? (r >> 1) ^ 0xEDB88320UL : r >> 1;
+        }
+        ret.t[0][c] = r;
+    }
+    for (size_t k = 1; k < 16; ++k) {
+        for (size_t c = 0; c < 256; ++c) {
+            ret.t[k][c] = (ret.t[k - 1][c] >> 8) ^ ret.t[0][ret.t[k - 1][c] & 0xFF];
+        }
+    }
+    return ret;
+}
+
+static constexpr crc32_tables crc_tables = make_crc32_tables();
+
 uint32_t crc32_hash(uint32_t hash, uint8_t c) {
-    static CRC32_TABLE crc_table;
-    return crc_table[(hash ^ c) & 0xFF] ^ (hash >> 8);
-}
\ No newline at end of file
+    return crc_tables.t[0][(hash ^ c) & 0xFF] ^ (hash >> 8);
+}
+
+static uint64_t load_le64_(uint8_t const* p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static uint32_t crc32_slicing_(uint32_t hash, uint8_t const* data, size_t len) {
+    auto const& t = crc_tables.t;
+    for (; len >= 16; data += 16, len -= 16) {
+        uint64_t a = load_le64_(data) ^ hash;
+        uint64_t b = load_le64_(data + 8);
+        hash = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^ t[13][(a >> 16) & 0xFF] ^ t[12][(a >> 24) & 0xFF]
+             ^ t[11][(a >> 32) & 0xFF] ^ t[10][(a >> 40) & 0xFF] ^ t[9][(a >> 48) & 0xFF] ^ t[8][a >> 56]
+             ^ t[7][b & 0xFF] ^ t[6][(b >> 8) & 0xFF] ^ t[5][(b >> 16) & 0xFF] ^ t[4][(b >> 24) & 0xFF]
+             ^ t[3][(b >> 32) & 0xFF] ^ t[2][(b >> 40) & 0xFF] ^ t[1][(b >> 48) & 0xFF] ^ t[0][b >> 56];
+    }
+    for (; len; --len) {
+        hash = crc32_hash(hash, *data++);
+    }
+    return hash;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32_CLMUL
+#include <immintrin.h>
+
+// folds 64 bytes per step with carry-less multiplication and finishes
+// with a Barrett reduction, see Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction"; len >= 64 and len % 16 == 0
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul_(uint32_t hash, uint8_t const* data, size_t len) {
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    x1 = _mm_loadu_si128((__m128i const*) (data + 0x00));
+    x2 = _mm_loadu_si128((__m128i const*) (data + 0x10));
+    x3 = _mm_loadu_si128((__m128i const*) (data + 0x20));
+    x4 = _mm_loadu_si128((__m128i const*) (data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(hash));
+    x0 = _mm_load_si128((__m128i const*) k1k2);
+    data += 64;
+    len -= 64;
+
+    for (; len >= 64; data += 64, len -= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((__m128i const*) (data + 0x00));
+        y6 = _mm_loadu_si128((__m128i const*) (data + 0x10));
+        y7 = _mm_loadu_si128((__m128i const*) (data + 0x20));
+        y8 = _mm_loadu_si128((__m128i const*) (data + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    }
+
+    x0 = _mm_load_si128((__m128i const*) k3k4);
+    for (__m128i next : {x2, x3, x4}) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+    }
+    for (; len >= 16; data += 16, len -= 16) {
+        x2 = _mm_loadu_si128((__m128i const*) data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    }
+
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((__m128i const*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_load_si128((__m128i const*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static bool const has_clmul = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}();
+#endif
+
+uint32_t crc32_update(uint32_t hash, uint8_t const* data, size_t len) {
+#ifdef CRC32_CLMUL
+    if (len >= 64 && has_clmul) {
+        size_t chunk = len & ~(size_t) 15;
+        hash = crc32_clmul_(hash, data, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+#endif
+    return crc32_slicing_(hash, data, len);
+}
+
+// polynomial arithmetic modulo the CRC polynomial, bit-reflected, as in
+// zlib: multmodp multiplies, x2n[k] is x^(2^k)
+static constexpr uint32_t multmodp_(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if (!(a & (m - 1))) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xEDB88320UL : b >> 1;
+    }
+    return p;
+}
+
+struct crc32_powers {
+    uint32_t x2n[32];
+};
+
+static constexpr crc32_powers make_crc32_powers() {
+    crc32_powers ret {};
+    uint32_t p = 1u << 30;
+    ret.x2n[0] = p;
+    for (size_t n = 1; n < 32; ++n) {
+        ret.x2n[n] = p = multmodp_(p, p);
+    }
+    return ret;
+}
+
+static constexpr crc32_powers crc_powers = make_crc32_powers();
+
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    uint32_t p = 1u << 31;
+    for (size_t k = 3; len_b; len_b >>= 1, ++k) {
+        if (len_b & 1) {
+            p = multmodp_(crc_powers.x2n[k & 31], p);
+        }
+    }
+    return multmodp_(p, crc_a) ^ crc_b;
+}
+
+uint32_t crc32(void const* data, size_t len, uint32_t seed) {
+    return crc32_update(seed ^ CRCMASK, static_cast<uint8_t const*>(data), len) ^ CRCMASK;
+}
+
+// x86-64 builds get an AVX2 clone picked at load time; the byte loop
+// stays scalar, the wide part is flushing the sub-histograms
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__linux__)
+#define HISTOGRAM_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define HISTOGRAM_TARGETS
+#endif
+
+// four interleaved tables keep back-to-back equal bytes from waiting
+// on each other's increment, 32-bit bins are flushed every
+// HISTOGRAM_FLUSH bytes
+HISTOGRAM_TARGETS
+void histogram(uint8_t const* first, uint8_t const* last, size_t* counts) {
+    uint32_t tables[4][ALPH_SIZE] = {};
+    while (first != last) {
+        uint8_t const* end = first + std::min<size_t>(last - first, HISTOGRAM_FLUSH);
+        for (; end - first >= 16; first += 16) {
+            uint64_t a, b;
+            std::memcpy(&a, first, sizeof(a));
+            std::memcpy(&b, first + 8, sizeof(b));
+            for (size_t i = 0; i < 8; i += 4) {
+                ++tables[0][(a >> (8 * i)) & 0xFF];
+                ++tables[1][(a >> (8 * i + 8)) & 0xFF];
+                ++tables[2][(a >> (8 * i + 16)) & 0xFF];
+                ++tables[3][(a >> (8 * i + 24)) & 0xFF];
+                ++tables[0][(b >> (8 * i)) & 0xFF];
+                ++tables[1][(b >> (8 * i + 8)) & 0xFF];
+                ++tables[2][(b >> (8 * i + 16)) & 0xFF];
+                ++tables[3][(b >> (8 * i + 24)) & 0xFF];
+            }
+        }
+        for (; first != end; ++first) {
+            ++tables[0][*first];
+        }
+        for (size_t c = 0; c < ALPH_SIZE; ++c) {
+            counts[c] += (size_t) tables[0][c] + tables[1][c] + tables[2][c] + tables[3][c];
+        }
+        std::memset(tables, 0, sizeof(tables));
+    }
+}
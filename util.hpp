@@ -13,18 +13,49 @@
 
 #define CRCMASK 0xFFFFFFFFUL
 #define MTHREAD_LAUNCH_MINIMAL 4096000
-#define THREAD_CNT 8
-#define THREAD_EXP 3
+#define PARALLEL_CHUNK_SIZE 262144
+#define HISTOGRAM_FLUSH (1u << 20)
 
 #define ALPH_SIZE 256
+#define MAX_TREE_NODES (2 * ALPH_SIZE)
 #define BLOCK_SIZE_BYTES 4
 #define HASH_SIZE_BYTES 4
 #define HEADER_SIZE 8
+#define CANONICAL_FLAG 0x80000000UL
+
+#define BLOCK_INDEX_FLAG 0x80000000UL
+#define BLOCK_TABLE_FLAG 0x40000000UL
+#define TABLE_REF_FLAG 0x100UL
+#define MAX_TABLES 256
+#define BLOCK_STREAMS_FLAG 0x20000000UL
+#define BLOCK_STORED_FLAG 0x10000000UL
+#define BLOCK_COUNT_MASK 0x0FFFFFFFUL
+// input bytes per index entry, so per block, at most
+#define BLOCK_INPUT_MAX (1u << 27)
+#define INDEX_MAGIC 0x4D464849UL
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_TRAILER_SIZE 8
+
+#define ENCODE_BATCH 4096
+#define STREAM_BUFFER_SIZE (1u << 20)
+#define PIPELINE_DEPTH 2
+#define URING_BUFFER_SIZE (1u << 20)
+#define URING_DEPTH 8
+#define URING_ALIGNMENT 4096
+
+#define STREAM_CNT 4
+#define STREAM_MIN_BLOCK 1024
+#define STREAM_BLOCK_MAX (1u << 27)
+
+#define LOOKUP_BITS 10
+#define LOOKUP_SIZE (1u << LOOKUP_BITS)
 
 #include <thread>
 #include <vector>
 
 #include "bitset.hpp"
+#include "bitwriter.hpp"
+#include "threadpool.hpp"
 
 template <typename It>
 uint8_t convert_to_byte(It p) {
@@ -36,32 +67,12 @@ void write_binary_(T value, std::string::iterator data) {
         std::copy((uint8_t *) &value, (uint8_t *) &value + sizeof(T), data);
 }
 
-template <size_t t>
-constexpr uint32_t poly_hash = t & 1 ? (t >> 1) ^ 0xEDB88320UL : t >> 1;
-
-template <size_t i, size_t t>
-constexpr uint32_t for_hash256 = for_hash256<i - 1, poly_hash<t>>;
-
-template <size_t t>
-constexpr uint32_t for_hash256<0, t> = poly_hash<t>;
-
-template <size_t t>
-constexpr uint32_t hash256 = for_hash256<7, t>;
-
-template <size_t t, size_t r>
-struct crc32_table : crc32_table<t - 1, r + 1> {
-    constexpr crc32_table() { this->vals[t] = hash256<t>; }
-};
-
-template <size_t r>
-struct crc32_table<0, r> {
-    constexpr crc32_table() { this->vals[0] = hash256<0>; }
-
-    uint32_t operator[](size_t i) { return vals[i]; }
-
-protected:
-    uint32_t vals[r + 1];
-};
+template <typename T, typename It>
+T read_binary_(It data) {
+    T value;
+    std::copy(data, data + sizeof(T), (uint8_t *) &value);
+    return value;
+}
 
 template <typename InputIt, typename F, typename URet, typename U, typename... Args>
 void parallel_calc_impl(F&& f, U&&, InputIt first, InputIt last, URet& ret, std::input_iterator_tag, Args&&... args) {
@@ -72,44 +83,40 @@ template <typename ForwardIt, typename F, typename URet, typename U, typename...
 void parallel_calc_impl(F&& f, U&& u, ForwardIt first, ForwardIt last, URet& ret, std::forward_iterator_tag, Args&&... args) {
     typename std::iterator_traits<ForwardIt>::difference_type dist = std::distance(first, last);
 
-    if (dist < MTHREAD_LAUNCH_MINIMAL) {
+    thread_pool& pool = thread_pool::instance();
+    if (dist < MTHREAD_LAUNCH_MINIMAL || pool.size() == 1) {
         f(first, last, ret, std::forward<Args>(args)...);
         return;
     }
 
-    std::vector<URet> s(THREAD_CNT, ret);
-    std::vector<std::thread> t;
-
-    for (size_t i = 0; i < THREAD_CNT - 1; ++i) {
-        auto next = std::next(first, dist >> THREAD_EXP);
-        t.emplace_back(std::thread(f, first, next, std::ref(s[i]), std::ref(args)...));
-        first = next;
+    // many more chunks than threads, so that whoever is free takes the
+    // next one; results are still merged in input order
+    size_t parts = std::max<size_t>(pool.size(), dist / PARALLEL_CHUNK_SIZE);
+    std::vector<URet> s(parts, ret);
+    std::vector<ForwardIt> bounds(1, first);
+    for (size_t i = 1; i < parts; ++i) {
+        bounds.push_back(std::next(bounds.back(), dist * i / parts - dist * (i - 1) / parts));
     }
-    t.emplace_back(std::thread(f, first, last, std::ref(s.back()), std::ref(args)...));
+    bounds.push_back(last);
+
+    pool.run(parts, [&](size_t i) {
+        f(bounds[i], bounds[i + 1], s[i], args...);
+    });
 
-    t.front().join();
     ret = std::move(s[0]);
-    for (size_t i = 1; i < t.size(); ++i) {
-        t[i].join();
+    for (size_t i = 1; i < parts; ++i) {
         u(ret, s[i]);
     }
 }
 
-using CRC32_TABLE = crc32_table<255, 0>;
-
+// crc32_hash and crc32_update step the raw register (start from CRCMASK,
+// xor the result with CRCMASK), crc32 is the finished checksum and
+// takes the checksum of the preceding data as seed
 uint32_t crc32_hash(uint32_t hash, uint8_t c);
-
-template <typename InputIt>
-uint32_t crc32(InputIt first, InputIt last) {
-    using value_type = typename std::iterator_traits<InputIt>::value_type;
-    static_assert(sizeof(value_type) == 1);
-
-    uint32_t crc = CRCMASK;
-    std::for_each(first, last, [& crc](value_type const& c) {
-        crc = crc32_hash(crc, convert_to_byte(&c));
-    });
-    return crc ^ CRCMASK;
-}
+uint32_t crc32_update(uint32_t hash, uint8_t const* data, size_t len);
+uint32_t crc32(void const* data, size_t len, uint32_t seed = 0);
+// crc32 of a + b from crc32(a), crc32(b) and the length of b
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
 
 template <typename Iterator>
 struct carries_trivially_copyable {
@@ -127,45 +134,380 @@ struct carries_byte_data {
 template <typename Iterator>
 constexpr bool carries_byte_data_v = carries_byte_data<Iterator>::value;
 
+// pointers and vector / string iterators, whose elements sit in one array
+template <typename Iterator, typename Value = std::remove_cv_t<typename std::iterator_traits<Iterator>::value_type>>
+struct is_contiguous_iterator {
+    static const bool value = std::is_pointer_v<Iterator>
+        || (!std::is_same_v<Value, bool>
+            && (std::is_same_v<Iterator, typename std::vector<Value>::iterator>
+                || std::is_same_v<Iterator, typename std::vector<Value>::const_iterator>))
+        || std::is_same_v<Iterator, std::string::iterator>
+        || std::is_same_v<Iterator, std::string::const_iterator>;
+};
+
+template <typename Iterator>
+constexpr bool is_contiguous_iterator_v = is_contiguous_iterator<Iterator>::value;
+
+// input iterator over the first n elements of [first, last); all copies
+// share one position, so the rest can be read on after it is exhausted
+template <typename InputIt>
+class bounded_input {
+public:
+    struct state {
+        InputIt it;
+        InputIt last;
+        size_t left;
+    };
+
+    typedef std::input_iterator_tag iterator_category;
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+    typedef typename std::iterator_traits<InputIt>::difference_type difference_type;
+    typedef typename std::iterator_traits<InputIt>::pointer pointer;
+    typedef typename std::iterator_traits<InputIt>::reference reference;
+
+    // the end iterator when state is null
+    explicit bounded_input(state* s = nullptr)
+    : s_(s) {}
+
+    reference operator*() const {
+        return *s_->it;
+    }
+
+    bounded_input& operator++() {
+        ++s_->it;
+        --s_->left;
+        return *this;
+    }
+
+    bool operator==(bounded_input const& other) const {
+        return done_() == other.done_();
+    }
+
+    bool operator!=(bounded_input const& other) const {
+        return !(*this == other);
+    }
+
+private:
+    state* s_;
+
+    bool done_() const {
+        return !s_ || !s_->left || s_->it == s_->last;
+    }
+};
+
+template <typename InputIt>
+uint32_t crc32(InputIt first, InputIt last) {
+    using value_type = typename std::iterator_traits<InputIt>::value_type;
+    static_assert(sizeof(value_type) == 1);
+
+    if constexpr (is_contiguous_iterator_v<InputIt>) {
+        return first == last ? 0 : crc32(&(*first), std::distance(first, last));
+    }
+    uint32_t crc = CRCMASK;
+    std::for_each(first, last, [& crc](value_type const& c) {
+        crc = crc32_hash(crc, convert_to_byte(&c));
+    });
+    return crc ^ CRCMASK;
+}
+
 template <typename Iterator, typename F, typename URet, typename U, typename... Args>
 void parallel_calc(F&& f, U&& u, Iterator first, Iterator last, URet& ret, Args&&... args) {
     typedef typename std::iterator_traits<Iterator>::iterator_category category;
     parallel_calc_impl(std::forward<F>(f), std::forward<U>(u), first, last, ret, category(), std::forward<Args>(args)...);
 }
 
+// adds the byte counts of [first, last) to counts[0..ALPH_SIZE)
+void histogram(uint8_t const* first, uint8_t const* last, size_t* counts);
+
 template <typename InputIt>
 void count_impl(InputIt first, InputIt last, std::vector<size_t>& store) {
     typedef typename std::iterator_traits<InputIt>::value_type value_type;
 
-    while (first != last) {
-        auto reintr_ptr = reinterpret_cast<uint8_t const*>(&(*first++));
+    if constexpr (is_contiguous_iterator_v<InputIt>) {
+        if (first != last) {
+            auto data = reinterpret_cast<uint8_t const*>(&(*first));
+            histogram(data, data + std::distance(first, last) * sizeof(value_type), store.data());
+        }
+        return;
+    }
+    for (; first != last; ++first) {
+        auto reintr_ptr = reinterpret_cast<uint8_t const*>(&(*first));
         for (size_t i = 0; i < sizeof(value_type); ++i) {
             ++store[reintr_ptr[i]];
         }
     }
 }
 
+// flat symbol -> code map: every entry is (code << 8) | length, codes
+// longer than PACKED_CODE_BITS keep an index into overflow instead
+struct code_table {
+    uint64_t words[ALPH_SIZE] = {};
+    std::vector<bitset> overflow;
+    size_t max_len = 0;
+
+    void clear() {
+        std::fill(words, words + ALPH_SIZE, 0);
+        overflow.clear();
+        max_len = 0;
+    }
+
+    void assign(uint8_t c, bitset const& code) {
+        uint64_t word = 0;
+        if (code.size() > PACKED_CODE_BITS) {
+            word = overflow.size();
+            overflow.push_back(code);
+        } else {
+            for (size_t i = 0; i < code.size(); ++i) {
+                word = (word << 1) | code[i];
+            }
+        }
+        words[c] = (word << 8) | code.size();
+        max_len = std::max(max_len, code.size());
+    }
+
+    bitset get(uint8_t c) const {
+        size_t len = words[c] & 0xFF;
+        if (len > PACKED_CODE_BITS) {
+            return overflow[words[c] >> 8];
+        }
+        bitset ret(len);
+        for (size_t i = 0; i < len; ++i) {
+            if ((words[c] >> (8 + len - 1 - i)) & 1) {
+                ret.set(i);
+            }
+        }
+        return ret;
+    }
+};
+
 template <typename InputIt>
-void encode_impl(InputIt first, std::enable_if_t<carries_trivially_copyable_v<InputIt>, InputIt> last, std::string& ret, bitset const* bs) {
+size_t encode_bits_(InputIt first, InputIt last, std::string& ret, code_table const& table) {
     typedef typename std::iterator_traits<InputIt>::value_type value_type;
 
-    bitset bsret;
-    uint32_t encoded = 0;
+    bit_writer bw(ret);
+    size_t encoded = 0;
 
     while (first != last) {
-        auto reintr_ptr = reinterpret_cast<uint8_t const*>(&(*first++));
-        for (size_t i = 0; i < sizeof(value_type); ++i) {
-            ++encoded;
-            bsret.append(bs[reintr_ptr[i]]);
+        bw.reserve((ENCODE_BATCH + sizeof(value_type)) * table.max_len);
+        // the value is read before the iterator moves: input iterators
+        // may keep it inside
+        for (size_t k = 0; k < ENCODE_BATCH && first != last; k += sizeof(value_type), ++first) {
+            auto reintr_ptr = reinterpret_cast<uint8_t const*>(&(*first));
+            for (size_t i = 0; i < sizeof(value_type); ++i) {
+                uint64_t word = table.words[reintr_ptr[i]];
+                auto len = (uint32_t) (word & 0xFF);
+                if (len - 1 < PACKED_CODE_BITS) {
+                    bw.put(word >> 8, len);
+                } else if (len) {
+                    bw.put(table.overflow[word >> 8]);
+                }
+            }
+            encoded += sizeof(value_type);
         }
     }
+    bw.finish();
+    return encoded;
+}
+
+// fills in the header of the block that starts at ret[start]
+inline void finish_block_(std::string& ret, size_t start, size_t encoded, uint32_t flags) {
+    if (encoded > BLOCK_COUNT_MASK) {
+        throw std::length_error("block is too large");
+    }
+    write_binary_((uint32_t) encoded | flags, ret.begin() + start + HASH_SIZE_BYTES);
+    uint32_t hash = crc32(ret.data() + start + HASH_SIZE_BYTES, ret.size() - start - HASH_SIZE_BYTES);
+    write_binary_(hash, ret.begin() + start);
+}
 
-    ret = std::string(HEADER_SIZE, '0');
-    ret.append(bsret.begin(), bsret.end());
+// storage kept between encode calls: the parts encoded in parallel
+// before they are appended to the output, emptied once appended
+struct encode_scratch {
+    std::vector<std::string> parts;
+    std::vector<uint32_t> sizes;
+    std::vector<uint32_t> hashes;
+};
 
-    write_binary_(encoded, ret.begin() + HASH_SIZE_BYTES);
-    uint32_t hash = crc32(ret.begin() + HASH_SIZE_BYTES, ret.end());
-    write_binary_(hash, ret.begin());
+// the block writers below append to ret, so that its storage is reused
+
+// a stored block holds the input bytes as they are
+template <typename InputIt>
+void store_impl(InputIt first, InputIt last, std::string& ret) {
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+
+    size_t start = ret.size();
+    ret.append(HEADER_SIZE, '0');
+    if constexpr (is_contiguous_iterator_v<InputIt>) {
+        ret.append(reinterpret_cast<char const*>(&(*first)), std::distance(first, last) * sizeof(value_type));
+    } else {
+        for (; first != last; ++first) {
+            auto reintr_ptr = reinterpret_cast<char const*>(&(*first));
+            ret.append(reintr_ptr, sizeof(value_type));
+        }
+    }
+    finish_block_(ret, start, ret.size() - start - HEADER_SIZE, BLOCK_STORED_FLAG);
+}
+
+template <typename InputIt>
+void encode_impl(InputIt first, std::enable_if_t<carries_trivially_copyable_v<InputIt>, InputIt> last, std::string& ret,
+        code_table const& table) {
+    size_t start = ret.size();
+    ret.append(HEADER_SIZE, '0');
+    finish_block_(ret, start, encode_bits_(first, last, ret, table), 0);
+}
+
+// input that can be read again is stored instead if the code turns out
+// no shorter than the input
+template <typename InputIt>
+void encode_or_store_impl(InputIt first, InputIt last, std::string& ret, code_table const& table) {
+    typedef typename std::iterator_traits<InputIt>::iterator_category category;
+
+    size_t start = ret.size();
+    encode_impl(first, last, ret, table);
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+        size_t encoded = read_binary_<uint32_t>(ret.begin() + start + HASH_SIZE_BYTES) & BLOCK_COUNT_MASK;
+        if (encoded && ret.size() - start - HEADER_SIZE >= encoded) {
+            ret.resize(start);
+            store_impl(first, last, ret);
+        }
+    }
+}
+
+// start of part i of n equal parts of [first, first + dist); random access
+// input needs no table of the bounds
+template <typename ForwardIt>
+class part_bounds {
+    static constexpr bool random_access_ = std::is_base_of_v<std::random_access_iterator_tag,
+            typename std::iterator_traits<ForwardIt>::iterator_category>;
+
+    ForwardIt first_;
+    ForwardIt last_;
+    size_t n_;
+    size_t dist_;
+    size_t step_;
+    std::vector<ForwardIt> bounds_;
+
+    size_t offset_(size_t i) const {
+        return i == n_ ? dist_ : step_ ? step_ * i : dist_ * i / n_;
+    }
+
+public:
+    // n parts of step elements each, the last one takes the rest; step 0
+    // splits evenly
+    part_bounds(ForwardIt first, ForwardIt last, size_t n, size_t step = 0)
+    : first_(first)
+    , last_(last)
+    , n_(n)
+    , dist_(std::distance(first, last))
+    , step_(step) {
+        if constexpr (!random_access_) {
+            bounds_.push_back(first);
+            for (size_t i = 1; i < n; ++i) {
+                bounds_.push_back(std::next(bounds_.back(), offset_(i) - offset_(i - 1)));
+            }
+            bounds_.push_back(last);
+        }
+    }
+
+    ForwardIt operator[](size_t i) const {
+        if constexpr (random_access_) {
+            return i == n_ ? last_ : first_ + offset_(i);
+        } else {
+            return bounds_[i];
+        }
+    }
+};
+
+// splits a block into groups * STREAM_CNT byte-aligned streams over
+// consecutive segments of the input: all but the last stream hold
+// count / (streams * 8) * 8 bytes, so that segment borders never cut a
+// value. The block header is followed by the stream count and the sizes
+// of all streams but the last. Each group of STREAM_CNT streams is encoded
+// and hashed by its own task, the block hash is combined from the parts.
+template <typename ForwardIt>
+void encode_streams_impl(ForwardIt first, ForwardIt last, std::string& ret, code_table const& table, size_t groups,
+        encode_scratch& scratch) {
+    typedef typename std::iterator_traits<ForwardIt>::value_type value_type;
+
+    size_t total = std::distance(first, last) * sizeof(value_type);
+    if (total < STREAM_MIN_BLOCK || 8 % sizeof(value_type)) {
+        encode_or_store_impl(first, last, ret, table);
+        return;
+    }
+    if (total > BLOCK_COUNT_MASK) {
+        throw std::length_error("block is too large");
+    }
+    groups = std::max<size_t>(1, std::min(groups, total / STREAM_MIN_BLOCK));
+    size_t streams = groups * STREAM_CNT;
+    size_t segment = total / (streams * 8) * 8 / sizeof(value_type);
+
+    part_bounds<ForwardIt> bounds(first, last, groups, segment * STREAM_CNT);
+    auto& data = scratch.parts;
+    auto& sizes = scratch.sizes;
+    auto& hashes = scratch.hashes;
+    data.resize(std::max(data.size(), groups));
+    sizes.resize(streams);
+    hashes.resize(groups);
+    thread_pool::instance().run(groups, [&](size_t g) {
+        auto it = bounds[g];
+        data[g].clear();
+        for (size_t k = 0; k < STREAM_CNT; ++k) {
+            auto next = k + 1 < STREAM_CNT ? std::next(it, segment) : bounds[g + 1];
+            size_t start = data[g].size();
+            encode_bits_(it, next, data[g], table);
+            sizes[g * STREAM_CNT + k] = data[g].size() - start;
+            it = next;
+        }
+        hashes[g] = crc32(data[g].data(), data[g].size());
+    });
+
+    size_t encoded = 4 * streams;
+    for (size_t g = 0; g < groups; ++g) {
+        encoded += data[g].size();
+    }
+    if (encoded >= total) {
+        store_impl(first, last, ret);
+        return;
+    }
+
+    size_t start = ret.size();
+    ret.append(HEADER_SIZE + 4 * streams, '0');
+    auto header = ret.begin() + start;
+    write_binary_((uint32_t) total | BLOCK_STREAMS_FLAG, header + HASH_SIZE_BYTES);
+    write_binary_((uint32_t) streams, header + HEADER_SIZE);
+    for (size_t k = 0; k + 1 < streams; ++k) {
+        write_binary_(sizes[k], header + HEADER_SIZE + 4 * (k + 1));
+    }
+    uint32_t hash = crc32(ret.data() + start + HASH_SIZE_BYTES, HEADER_SIZE + 4 * streams - HASH_SIZE_BYTES);
+    for (size_t g = 0; g < groups; ++g) {
+        hash = crc32_combine(hash, hashes[g], data[g].size());
+        ret += data[g];
+        data[g].clear();
+    }
+    write_binary_(hash, ret.begin() + start);
+}
+
+template <typename InputIt>
+void parallel_encode_streams_(InputIt first, InputIt last, std::string& ret, code_table const& table, encode_scratch&,
+        std::input_iterator_tag) {
+    encode_impl(first, last, ret, table);
+}
+
+// one block per STREAM_BLOCK_MAX bytes, large blocks get a group of
+// streams per pool thread
+template <typename ForwardIt>
+void parallel_encode_streams_(ForwardIt first, ForwardIt last, std::string& ret, code_table const& table,
+        encode_scratch& scratch, std::forward_iterator_tag) {
+    typedef typename std::iterator_traits<ForwardIt>::value_type value_type;
+
+    size_t dist = std::distance(first, last);
+    size_t max_block = STREAM_BLOCK_MAX / sizeof(value_type);
+    size_t groups = dist * sizeof(value_type) < MTHREAD_LAUNCH_MINIMAL ? 1 : thread_pool::instance().size();
+    do {
+        auto next = dist > max_block ? std::next(first, max_block) : last;
+        encode_streams_impl(first, next, ret, table, groups, scratch);
+        dist -= std::min(dist, max_block);
+        first = next;
+    } while (dist);
 }
 
 template <typename Iterator>
@@ -177,11 +519,48 @@ void parallel_count(Iterator first, Iterator last, std::vector<size_t>& store) {
             first, last, store);
 }
 
+template <typename InputIt>
+void parallel_encode_(InputIt first, InputIt last, std::string& ret, code_table const& table, encode_scratch&,
+        std::input_iterator_tag) {
+    encode_or_store_impl(first, last, ret, table);
+}
+
+// many more parts than threads, so that whoever is free takes the next
+// one; the parts are appended in input order
+template <typename ForwardIt>
+void parallel_encode_(ForwardIt first, ForwardIt last, std::string& ret, code_table const& table,
+        encode_scratch& scratch, std::forward_iterator_tag) {
+    size_t dist = std::distance(first, last);
+    thread_pool& pool = thread_pool::instance();
+    if (dist < MTHREAD_LAUNCH_MINIMAL || pool.size() == 1) {
+        encode_or_store_impl(first, last, ret, table);
+        return;
+    }
+    size_t parts = std::max<size_t>(pool.size(), dist / PARALLEL_CHUNK_SIZE);
+    part_bounds<ForwardIt> bounds(first, last, parts);
+    auto& data = scratch.parts;
+    data.resize(std::max(data.size(), parts));
+    pool.run(parts, [&](size_t i) {
+        data[i].clear();
+        encode_or_store_impl(bounds[i], bounds[i + 1], data[i], table);
+    });
+    for (size_t i = 0; i < parts; ++i) {
+        ret += data[i];
+        data[i].clear();
+    }
+}
+
+template <typename Iterator>
+void parallel_encode(Iterator first, Iterator last, std::string& ret, code_table const& table, encode_scratch& scratch) {
+    typedef typename std::iterator_traits<Iterator>::iterator_category category;
+    parallel_encode_(first, last, ret, table, scratch, category());
+}
+
 template <typename Iterator>
-void parallel_encode(Iterator first, Iterator last, std::string& ret, bitset* bs) {
-    parallel_calc(encode_impl<Iterator>,
-            [](std::string& dst, std::string const& src){ dst += src; },
-            first, last, ret, bs);
+void parallel_encode_streams(Iterator first, Iterator last, std::string& ret, code_table const& table,
+        encode_scratch& scratch) {
+    typedef typename std::iterator_traits<Iterator>::iterator_category category;
+    parallel_encode_streams_(first, last, ret, table, scratch, category());
 }
 
 #endif // HUFFMAN_UTIL_HPP